@@ -8,32 +8,184 @@
 #include <QImage>
 #include <QLabel>
 #include <QMessageBox>
+#include <QPaintEvent>
 #include <QPixmap>
 #include <QScrollBar>
+#include <QShortcut>
+#include <QWheelEvent>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <opencv2/opencv.hpp>
+#ifdef IMAGECRAFT_HAVE_LIBJPEG
+#include "JpegLossless.h"   // lossless JPEG export, link with libjpeg
+#endif
+#include <set>
 #include <string>
+#include <thread>
 
 using namespace std;
 using namespace cv;
 
-Mat universal_image_for_resize;
-Mat universal_image_for_brightness;
-Mat universal_image_for_contrast;
-Mat universal_image_for_blur;
-Mat universal_image_for_crop;
-
 Mat original_image;		// Holds the original image data
+string original_path;   // file original_image was decoded from
 
 QPoint startPoint;     // Starting point of the mouse drag
 QPoint endPoint;       // Ending point of the mouse drag
 bool isDragging = false; // Flag to track if cropping is in progress
+bool isPanning = false;     // right or middle button drag moves a zoomed view
+QPoint panPoint;            // last position of the pan drag
 QRect selectionRect;	// Rectangle to display the selection area
 
 int current_image_width = 0;
 int current_image_height = 0;
 
+// Scoped timing of the hot paths, written as Chrome trace_event JSON for chrome://tracing or Perfetto.
+// Only built with IMAGECRAFT_ENABLE_TRACING defined, otherwise every IMAGECRAFT_TRACE expands to nothing.
+// The trace goes to IMAGECRAFT_TRACE (imagecraft_trace.json by default) when the program exits, and
+// IMAGECRAFT_LATENCY_OVERLAY=1 shows input-to-display latency percentiles in the status bar.
+#ifdef IMAGECRAFT_ENABLE_TRACING
+class Tracer {
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+    void record(const char* name, int64 start, int64 end) {    // name must be a string literal, only the pointer is kept
+        Event event{ name, start, end, threadId() };
+        lock_guard<std::mutex> lock(guard);
+        if (events.size() < max_events) {
+            events.push_back(event);
+        }
+        else {
+            dropped++;
+        }
+    }
+    bool save(const string& path) {
+        lock_guard<std::mutex> lock(guard);
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+        double us_per_tick = 1e6 / getTickFrequency();
+        int64 origin = LLONG_MAX;   // the first scope to open is time zero
+        for (const Event& e : events) {
+            origin = min(origin, e.start);
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& e = events[i];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"imagecraft\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                i ? "," : "", e.name, e.thread, (e.start - origin) * us_per_tick, (e.end - e.start) * us_per_tick);
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        cout << "Wrote " << events.size() << " trace events to " << path;
+        if (dropped) {
+            cout << ", dropped " << dropped << " past the limit";
+        }
+        cout << endl;
+        return true;
+    }
+
+private:
+    struct Event {
+        const char* name;
+        int64 start, end;
+        int thread;
+    };
+    Tracer() = default;
+    ~Tracer() {     // after main returns, every thread that records has been joined
+        if (!events.empty()) {
+            const char* path = getenv("IMAGECRAFT_TRACE");
+            save(path ? path : "imagecraft_trace.json");
+        }
+    }
+    static int threadId() {     // small stable numbers read better in the trace viewer than native ids
+        static std::atomic<int> next{ 1 };
+        thread_local int id = next++;
+        return id;
+    }
+
+    static const size_t max_events = 1 << 20;   // about 24 MB, a long session keeps its first million events
+    std::mutex guard;
+    vector<Event> events;
+    size_t dropped = 0;
+};
+
+class Trace_Scope {     // one complete event from construction to the end of the enclosing scope
+public:
+    explicit Trace_Scope(const char* name) : name(name), start(getTickCount()) {}
+    ~Trace_Scope() { Tracer::instance().record(name, start, getTickCount()); }
+    Trace_Scope(const Trace_Scope&) = delete;
+    Trace_Scope& operator=(const Trace_Scope&) = delete;
+
+private:
+    const char* name;
+    int64 start;
+};
+
+class Latency_Window {      // input-to-display latency of the most recent frames
+public:
+    void add(double ms) {
+        samples[count % samples.size()] = ms;
+        count++;
+    }
+    double percentile(double p) const {
+        vector<double> sorted(samples.begin(), samples.begin() + min(count, samples.size()));
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t rank = min(sorted.size() - 1, static_cast<size_t>(p / 100.0 * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+    size_t frames() const { return count; }
+
+private:
+    vector<double> samples = vector<double>(256);
+    size_t count = 0;
+};
+
+Latency_Window display_latency;     // GUI thread only
+const bool latency_overlay = getenv("IMAGECRAFT_LATENCY_OVERLAY") != nullptr;
+
+void recordDisplayLatency(int64 input_tick, QStatusBar* status_bar) {     // called once the frame is on the label
+    display_latency.add((getTickCount() - input_tick) * 1000.0 / getTickFrequency());
+    if (latency_overlay) {
+        status_bar->showMessage(QString("Input to display: p50 %1 ms, p95 %2 ms, p99 %3 ms over %4 frames")
+            .arg(display_latency.percentile(50), 0, 'f', 1).arg(display_latency.percentile(95), 0, 'f', 1)
+            .arg(display_latency.percentile(99), 0, 'f', 1).arg(min<size_t>(display_latency.frames(), 256)));
+    }
+}
+
+#define IMAGECRAFT_TRACE_JOIN(a, b) a##b
+#define IMAGECRAFT_TRACE_SCOPE(name, line) Trace_Scope IMAGECRAFT_TRACE_JOIN(trace_scope_, line)(name)
+#define IMAGECRAFT_TRACE(name) IMAGECRAFT_TRACE_SCOPE(name, __LINE__)
+#define IMAGECRAFT_INPUT_TICK() getTickCount()
+#define IMAGECRAFT_DISPLAYED(input_tick, status_bar) recordDisplayLatency(input_tick, status_bar)
+#else
+#define IMAGECRAFT_TRACE(name) ((void)0)
+#define IMAGECRAFT_INPUT_TICK() int64(0)
+#define IMAGECRAFT_DISPLAYED(input_tick, status_bar) ((void)(input_tick))
+#endif
+
 
 class Image {
 private:
@@ -41,6 +193,7 @@ private:
 
 public:
     void loadImage(const string& path) {    // load an image from the specified path
+        IMAGECRAFT_TRACE("decode");
         img = imread(path);
         if (img.empty()) {
             cout << "Error: Could not load the image from " << path << endl;
@@ -49,33 +202,651 @@ public:
             cout << "Image loaded successfully from " << path << endl;
         }
     }
+    Mat loadPreview(const string& path, int max_width, int max_height, int& reduction) const {   // DCT-scaled JPEG decode, empty when not worth it
+        Size size;
+        reduction = 1;
+        if (!jpegSize(path, size)) {
+            return Mat();
+        }
+        while (reduction < 8 && size.width / (reduction * 2) >= max_width && size.height / (reduction * 2) >= max_height) {
+            reduction *= 2;     // largest 1/2, 1/4 or 1/8 scale that still fills the display
+        }
+        if (reduction == 1) {
+            return Mat();
+        }
+        IMAGECRAFT_TRACE("decode reduced");
+        int flags = reduction == 2 ? IMREAD_REDUCED_COLOR_2 : (reduction == 4 ? IMREAD_REDUCED_COLOR_4 : IMREAD_REDUCED_COLOR_8);
+        return imread(path, flags);
+    }
+    void setImageData(const Mat& data) { img = data; }  // full-resolution image decoded elsewhere
+    void clear() { img.release(); }
     Mat getImageData() const { return img; } // retrieve image data
     bool isImageLoaded() const { return !img.empty(); }  // check if an image is loaded
+
+private:
+    static bool jpegSize(const string& path, Size& size) {     // reads the frame header only, false for anything but a JPEG
+        ifstream file(path, ios::binary);
+        if (file.get() != 0xFF || file.get() != 0xD8) {
+            return false;
+        }
+        while (file) {
+            int marker = file.get();
+            if (marker != 0xFF) {
+                return false;
+            }
+            while (marker == 0xFF) {
+                marker = file.get();    // markers may be padded with extra 0xFF bytes
+            }
+            if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                continue;   // markers without a length
+            }
+            int length = readBigEndian16(file);
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {     // start of frame
+                file.get();     // sample precision
+                size.height = readBigEndian16(file);
+                size.width = readBigEndian16(file);
+                return file.good() && size.width > 0 && size.height > 0;
+            }
+            file.seekg(length - 2, ios::cur);
+        }
+        return false;
+    }
+    static int readBigEndian16(istream& file) {
+        int high = file.get();
+        return (high << 8) | file.get();
+    }
+};
+class Point_Op_Chain {      // compiles a sequence of per-pixel 8-bit operations into one lookup table per channel
+public:
+    Point_Op_Chain() {
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < 256; i++) {
+                lut[c][i] = static_cast<uchar>(i);
+            }
+        }
+    }
+    // every operation is composed onto the table, so a chain of any length is still applied in a single pass
+    Point_Op_Chain& brightness(int value, int channel = -1) {
+        return compose(channel, [value](int x) { return static_cast<float>(x + value); });
+    }
+    Point_Op_Chain& contrast(int value, int channel = -1) {
+        float alpha = static_cast<float>(1 + (value / 100.0));     // maps slider value (-100 to 100) to a scaling factor (0-2)
+        return compose(channel, [alpha](int x) { return x * alpha; });
+    }
+    Point_Op_Chain& invert(int channel = -1) {
+        return compose(channel, [](int x) { return static_cast<float>(255 - x); });
+    }
+    Point_Op_Chain& gamma(double value, int channel = -1) {    // values above 1 brighten the midtones
+        if (value <= 0) {
+            throw std::invalid_argument("Gamma must be positive.");
+        }
+        return compose(channel, [value](int x) { return static_cast<float>(255.0 * pow(x / 255.0, 1.0 / value)); });
+    }
+    Point_Op_Chain& levels(int in_black, int in_white, int out_black = 0, int out_white = 255, int channel = -1) {
+        if (in_white <= in_black) {
+            throw std::invalid_argument("Levels input white point must be above the black point.");
+        }
+        float slope = static_cast<float>(out_white - out_black) / (in_white - in_black);
+        return compose(channel, [=](int x) { return out_black + (min(max(x, in_black), in_white) - in_black) * slope; });
+    }
+    Point_Op_Chain& then(const Point_Op_Chain& next) {     // append another compiled chain
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < 256; i++) {
+                lut[c][i] = next.lut[c][lut[c][i]];
+            }
+        }
+        return *this;
+    }
+    bool isIdentity() const {
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < 256; i++) {
+                if (lut[c][i] != i) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    uchar map(int channel, uchar value) const {
+        return lut[channel][value];
+    }
+    Mat table(int channels) const {     // 1x256 table in the layout cv::LUT expects for an image with this many channels
+        Mat lookup(1, 256, CV_8UC(channels));
+        uchar* entries = lookup.ptr<uchar>(0);
+        for (int i = 0; i < 256; i++) {
+            for (int c = 0; c < channels; c++) {
+                entries[i * channels + c] = lut[c][i];
+            }
+        }
+        return lookup;
+    }
+    void apply(const Mat& img, Mat& result) const {     // one vectorized pass, result may alias img
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot apply point operations.");
+        }
+        if (img.depth() != CV_8U || img.channels() > 4) {
+            throw runtime_error("Point operations need an 8-bit image with up to 4 channels.");
+        }
+        LUT(img, table(img.channels()), result);
+    }
+    Mat apply(const Mat& img) const {
+        Mat result;
+        apply(img, result);
+        return result;
+    }
+
+private:
+    template<typename Op> Point_Op_Chain& compose(int channel, Op op) {
+        for (int c = 0; c < 4; c++) {
+            if (channel >= 0 && channel != c) {
+                continue;
+            }
+            for (int i = 0; i < 256; i++) {
+                lut[c][i] = saturate_cast<uchar>(op(lut[c][i]));     // rounds and clamps like convertTo
+            }
+        }
+        return *this;
+    }
+
+    uchar lut[4][256];
+};
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define IMAGECRAFT_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define IMAGECRAFT_TARGET(isa) __attribute__((target(isa)))     // lets one binary carry kernels for newer CPUs
+#else
+#define IMAGECRAFT_TARGET(isa)                                  // MSVC accepts any intrinsic without flags
+#endif
+
+struct Hsv_Window {     // the inRange windows of one isolated colour, S and V are open up to 255
+    int hue_lo[2], hue_hi[2];   // second hue range only used where the colour wraps around 180
+    int saturation_lo, value_lo;
+};
+
+// Fused colour isolation. Each BGR pixel is read once, converted to H, S and V with the same
+// fixed-point tables OpenCV uses for 8-bit COLOR_BGR2HSV, and written either as itself or as its
+// COLOR_BGR2GRAY value, so the output is bit-identical to cvtColor + inRange + copyTo.
+namespace color_isolation_kernel {
+    const int hsv_shift = 12;
+    const int gray_shift = 15;
+    const int gray_b = 3735, gray_g = 19235, gray_r = 9798;    // 0.114, 0.587, 0.299 in 1/32768 units
+
+    struct Tables {
+        int saturation_div[256];    // (255 << 12) / v
+        int hue_div[256];           // (180 << 12) / (6 * (max - min))
+        Tables() {
+            saturation_div[0] = hue_div[0] = 0;
+            for (int i = 1; i < 256; i++) {
+                saturation_div[i] = static_cast<int>(std::lround((255 << hsv_shift) / (1.0 * i)));
+                hue_div[i] = static_cast<int>(std::lround((180 << hsv_shift) / (6.0 * i)));
+            }
+        }
+    };
+    inline const Tables& tables() {
+        static const Tables instance;
+        return instance;
+    }
+
+    inline void rowScalar(const uchar* src, uchar* dst, int width, const Hsv_Window& w) {
+        const Tables& t = tables();
+        for (int x = 0; x < width; x++, src += 3, dst += 3) {
+            int b = src[0], g = src[1], r = src[2];
+            int v = std::max(b, std::max(g, r));
+            int diff = v - std::min(b, std::min(g, r));
+            int s = (diff * t.saturation_div[v] + (1 << (hsv_shift - 1))) >> hsv_shift;
+            int h = v == r ? g - b : (v == g ? b - r + 2 * diff : r - g + 4 * diff);
+            h = (h * t.hue_div[diff] + (1 << (hsv_shift - 1))) >> hsv_shift;
+            h += h < 0 ? 180 : 0;
+            bool keep = s >= w.saturation_lo && v >= w.value_lo &&
+                ((h >= w.hue_lo[0] && h <= w.hue_hi[0]) || (h >= w.hue_lo[1] && h <= w.hue_hi[1]));
+            if (keep) {
+                dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+            }
+            else {
+                dst[0] = dst[1] = dst[2] = static_cast<uchar>((b * gray_b + g * gray_g + r * gray_r + (1 << (gray_shift - 1))) >> gray_shift);
+            }
+        }
+    }
+
+#ifdef IMAGECRAFT_X86
+    // The vector rows work on 32-bit lanes, four pixels per 128-bit block. Every block loads and stores
+    // 16 bytes for 12 bytes of pixels, so rows stop a few pixels early and the scalar row finishes them.
+    IMAGECRAFT_TARGET("sse4.1") inline __m128i lanes128(__m128i pixels, int channel) {   // byte channel of 4 BGR pixels into 4 lanes
+        return _mm_shuffle_epi8(pixels, _mm_setr_epi8(
+            channel, -1, -1, -1, channel + 3, -1, -1, -1, channel + 6, -1, -1, -1, channel + 9, -1, -1, -1));
+    }
+    IMAGECRAFT_TARGET("sse4.1") inline __m128i pack128(__m128i bgr) {     // 4 lanes of 0x00RRGGBB back into 12 bytes
+        return _mm_shuffle_epi8(bgr, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    }
+
+    IMAGECRAFT_TARGET("sse4.1") void rowSse41(const uchar* src, uchar* dst, int width, const Hsv_Window& w) {
+        const Tables& t = tables();
+        const __m128i round_hsv = _mm_set1_epi32(1 << (hsv_shift - 1)), round_gray = _mm_set1_epi32(1 << (gray_shift - 1));
+        const __m128i hue_lo0 = _mm_set1_epi32(w.hue_lo[0] - 1), hue_hi0 = _mm_set1_epi32(w.hue_hi[0] + 1);
+        const __m128i hue_lo1 = _mm_set1_epi32(w.hue_lo[1] - 1), hue_hi1 = _mm_set1_epi32(w.hue_hi[1] + 1);
+        const __m128i s_lo = _mm_set1_epi32(w.saturation_lo - 1), v_lo = _mm_set1_epi32(w.value_lo - 1);
+        int x = 0;
+        for (; x + 6 <= width; x += 4) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+            __m128i b = lanes128(pixels, 0), g = lanes128(pixels, 1), r = lanes128(pixels, 2);
+            __m128i v = _mm_max_epi32(b, _mm_max_epi32(g, r));
+            __m128i diff = _mm_sub_epi32(v, _mm_min_epi32(b, _mm_min_epi32(g, r)));
+            int vi[4], di[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(vi), v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(di), diff);
+            __m128i s_div = _mm_setr_epi32(t.saturation_div[vi[0]], t.saturation_div[vi[1]], t.saturation_div[vi[2]], t.saturation_div[vi[3]]);
+            __m128i h_div = _mm_setr_epi32(t.hue_div[di[0]], t.hue_div[di[1]], t.hue_div[di[2]], t.hue_div[di[3]]);
+            __m128i s = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(diff, s_div), round_hsv), hsv_shift);
+            __m128i is_r = _mm_cmpeq_epi32(v, r), is_g = _mm_cmpeq_epi32(v, g);
+            __m128i diff2 = _mm_add_epi32(diff, diff);
+            __m128i h_g = _mm_add_epi32(_mm_sub_epi32(b, r), diff2);
+            __m128i h_b = _mm_add_epi32(_mm_sub_epi32(r, g), _mm_add_epi32(diff2, diff2));
+            __m128i h = _mm_blendv_epi8(_mm_blendv_epi8(h_b, h_g, is_g), _mm_sub_epi32(g, b), is_r);
+            h = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(h, h_div), round_hsv), hsv_shift);
+            h = _mm_add_epi32(h, _mm_and_si128(_mm_cmplt_epi32(h, _mm_setzero_si128()), _mm_set1_epi32(180)));
+            __m128i hue_in = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(h, hue_lo0), _mm_cmplt_epi32(h, hue_hi0)),
+                _mm_and_si128(_mm_cmpgt_epi32(h, hue_lo1), _mm_cmplt_epi32(h, hue_hi1)));
+            __m128i keep = _mm_and_si128(hue_in, _mm_and_si128(_mm_cmpgt_epi32(s, s_lo), _mm_cmpgt_epi32(v, v_lo)));
+            __m128i gray = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(b, _mm_set1_epi32(gray_b)), _mm_mullo_epi32(g, _mm_set1_epi32(gray_g))),
+                _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(gray_r)), round_gray));
+            gray = _mm_mullo_epi32(_mm_srli_epi32(gray, gray_shift), _mm_set1_epi32(0x010101));
+            __m128i original = _mm_or_si128(b, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(r, 16)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), pack128(_mm_blendv_epi8(gray, original, keep)));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, w);
+    }
+
+    IMAGECRAFT_TARGET("avx2") inline __m256i lanes256(__m256i pixels, int channel) {
+        __m128i mask = _mm_setr_epi8(channel, -1, -1, -1, channel + 3, -1, -1, -1, channel + 6, -1, -1, -1, channel + 9, -1, -1, -1);
+        return _mm256_shuffle_epi8(pixels, _mm256_broadcastsi128_si256(mask));
+    }
+
+    IMAGECRAFT_TARGET("avx2") void rowAvx2(const uchar* src, uchar* dst, int width, const Hsv_Window& w) {
+        const Tables& t = tables();
+        const __m256i round_hsv = _mm256_set1_epi32(1 << (hsv_shift - 1)), round_gray = _mm256_set1_epi32(1 << (gray_shift - 1));
+        const __m256i hue_lo0 = _mm256_set1_epi32(w.hue_lo[0] - 1), hue_hi0 = _mm256_set1_epi32(w.hue_hi[0] + 1);
+        const __m256i hue_lo1 = _mm256_set1_epi32(w.hue_lo[1] - 1), hue_hi1 = _mm256_set1_epi32(w.hue_hi[1] + 1);
+        const __m256i s_lo = _mm256_set1_epi32(w.saturation_lo - 1), v_lo = _mm256_set1_epi32(w.value_lo - 1);
+        const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+        int x = 0;
+        for (; x + 10 <= width; x += 8) {
+            const uchar* p = src + 3 * x;
+            __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+            __m256i b = lanes256(pixels, 0), g = lanes256(pixels, 1), r = lanes256(pixels, 2);
+            __m256i v = _mm256_max_epi32(b, _mm256_max_epi32(g, r));
+            __m256i diff = _mm256_sub_epi32(v, _mm256_min_epi32(b, _mm256_min_epi32(g, r)));
+            __m256i s_div = _mm256_i32gather_epi32(t.saturation_div, v, 4);
+            __m256i h_div = _mm256_i32gather_epi32(t.hue_div, diff, 4);
+            __m256i s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, s_div), round_hsv), hsv_shift);
+            __m256i is_r = _mm256_cmpeq_epi32(v, r), is_g = _mm256_cmpeq_epi32(v, g);
+            __m256i diff2 = _mm256_add_epi32(diff, diff);
+            __m256i h_g = _mm256_add_epi32(_mm256_sub_epi32(b, r), diff2);
+            __m256i h_b = _mm256_add_epi32(_mm256_sub_epi32(r, g), _mm256_add_epi32(diff2, diff2));
+            __m256i h = _mm256_blendv_epi8(_mm256_blendv_epi8(h_b, h_g, is_g), _mm256_sub_epi32(g, b), is_r);
+            h = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(h, h_div), round_hsv), hsv_shift);
+            h = _mm256_add_epi32(h, _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), h), _mm256_set1_epi32(180)));
+            __m256i hue_in = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi32(h, hue_lo0), _mm256_cmpgt_epi32(hue_hi0, h)),
+                _mm256_and_si256(_mm256_cmpgt_epi32(h, hue_lo1), _mm256_cmpgt_epi32(hue_hi1, h)));
+            __m256i keep = _mm256_and_si256(hue_in, _mm256_and_si256(_mm256_cmpgt_epi32(s, s_lo), _mm256_cmpgt_epi32(v, v_lo)));
+            __m256i gray = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(gray_b)), _mm256_mullo_epi32(g, _mm256_set1_epi32(gray_g))),
+                _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(gray_r)), round_gray));
+            gray = _mm256_mullo_epi32(_mm256_srli_epi32(gray, gray_shift), _mm256_set1_epi32(0x010101));
+            __m256i original = _mm256_or_si256(b, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(r, 16)));
+            __m256i out = _mm256_shuffle_epi8(_mm256_blendv_epi8(gray, original, keep), pack);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm256_castsi256_si128(out));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x + 12), _mm256_extracti128_si256(out, 1));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, w);
+    }
+
+    IMAGECRAFT_TARGET("avx512f,avx512bw") void rowAvx512(const uchar* src, uchar* dst, int width, const Hsv_Window& w) {
+        const Tables& t = tables();
+        const __m512i round_hsv = _mm512_set1_epi32(1 << (hsv_shift - 1)), round_gray = _mm512_set1_epi32(1 << (gray_shift - 1));
+        const __m512i hue_lo0 = _mm512_set1_epi32(w.hue_lo[0]), hue_hi0 = _mm512_set1_epi32(w.hue_hi[0]);
+        const __m512i hue_lo1 = _mm512_set1_epi32(w.hue_lo[1]), hue_hi1 = _mm512_set1_epi32(w.hue_hi[1]);
+        const __m512i s_lo = _mm512_set1_epi32(w.saturation_lo), v_lo = _mm512_set1_epi32(w.value_lo);
+        const __m512i pack = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+        const __m512i lanes_b = _mm512_broadcast_i32x4(_mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1));
+        const __m512i lanes_g = _mm512_broadcast_i32x4(_mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1));
+        const __m512i lanes_r = _mm512_broadcast_i32x4(_mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1));
+        int x = 0;
+        for (; x + 18 <= width; x += 16) {
+            const uchar* p = src + 3 * x;
+            __m512i pixels = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 24)), 2);
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 36)), 3);
+            __m512i b = _mm512_shuffle_epi8(pixels, lanes_b), g = _mm512_shuffle_epi8(pixels, lanes_g), r = _mm512_shuffle_epi8(pixels, lanes_r);
+            __m512i v = _mm512_max_epi32(b, _mm512_max_epi32(g, r));
+            __m512i diff = _mm512_sub_epi32(v, _mm512_min_epi32(b, _mm512_min_epi32(g, r)));
+            __m512i s_div = _mm512_i32gather_epi32(v, t.saturation_div, 4);
+            __m512i h_div = _mm512_i32gather_epi32(diff, t.hue_div, 4);
+            __m512i s = _mm512_srai_epi32(_mm512_add_epi32(_mm512_mullo_epi32(diff, s_div), round_hsv), hsv_shift);
+            __mmask16 is_r = _mm512_cmpeq_epi32_mask(v, r), is_g = _mm512_cmpeq_epi32_mask(v, g);
+            __m512i diff2 = _mm512_add_epi32(diff, diff);
+            __m512i h = _mm512_add_epi32(_mm512_sub_epi32(r, g), _mm512_add_epi32(diff2, diff2));
+            h = _mm512_mask_mov_epi32(h, is_g, _mm512_add_epi32(_mm512_sub_epi32(b, r), diff2));
+            h = _mm512_mask_mov_epi32(h, is_r, _mm512_sub_epi32(g, b));
+            h = _mm512_srai_epi32(_mm512_add_epi32(_mm512_mullo_epi32(h, h_div), round_hsv), hsv_shift);
+            h = _mm512_mask_add_epi32(h, _mm512_cmplt_epi32_mask(h, _mm512_setzero_si512()), h, _mm512_set1_epi32(180));
+            __mmask16 hue_in = (_mm512_cmpge_epi32_mask(h, hue_lo0) & _mm512_cmple_epi32_mask(h, hue_hi0)) |
+                (_mm512_cmpge_epi32_mask(h, hue_lo1) & _mm512_cmple_epi32_mask(h, hue_hi1));
+            __mmask16 keep = hue_in & _mm512_cmpge_epi32_mask(s, s_lo) & _mm512_cmpge_epi32_mask(v, v_lo);
+            __m512i gray = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(b, _mm512_set1_epi32(gray_b)), _mm512_mullo_epi32(g, _mm512_set1_epi32(gray_g))),
+                _mm512_add_epi32(_mm512_mullo_epi32(r, _mm512_set1_epi32(gray_r)), round_gray));
+            gray = _mm512_mullo_epi32(_mm512_srli_epi32(gray, gray_shift), _mm512_set1_epi32(0x010101));
+            __m512i original = _mm512_or_si512(b, _mm512_or_si512(_mm512_slli_epi32(g, 8), _mm512_slli_epi32(r, 16)));
+            __m512i out = _mm512_shuffle_epi8(_mm512_mask_mov_epi32(gray, keep, original), pack);
+            uchar* q = dst + 3 * x;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q), _mm512_castsi512_si128(out));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 12), _mm512_extracti32x4_epi32(out, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 24), _mm512_extracti32x4_epi32(out, 2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 36), _mm512_extracti32x4_epi32(out, 3));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, w);
+    }
+#endif
+
+    typedef void (*Row)(const uchar* src, uchar* dst, int width, const Hsv_Window& w);
+    inline Row selectRow() {        // widest instruction set this CPU supports
+#ifdef IMAGECRAFT_X86
+        if (checkHardwareSupport(CV_CPU_AVX_512BW)) {
+            return rowAvx512;
+        }
+        if (checkHardwareSupport(CV_CPU_AVX2)) {
+            return rowAvx2;
+        }
+        if (checkHardwareSupport(CV_CPU_SSE4_1)) {
+            return rowSse41;
+        }
+#endif
+        return rowScalar;
+    }
+}
+
+struct Color_Matrix {   // 3x3 channel mixer on BGR pixels in fixed point, out[i] = sum of coefficients[i][j] * in[j]
+    short coefficients[3][3];   // rows are the output channels, columns the input channels, both in Mat order
+    int shift = 15;             // coefficients are scaled by 2^shift
+
+    static Color_Matrix fromFloat(const float m[3][3]) {    // the finest scale at which every coefficient still fits in int16
+        float largest = 0;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                largest = max(largest, std::abs(m[i][j]));
+            }
+        }
+        Color_Matrix matrix;
+        while (matrix.shift > 1 && largest * (1 << matrix.shift) > SHRT_MAX) {
+            matrix.shift--;
+        }
+        if (largest * (1 << matrix.shift) > SHRT_MAX) {
+            throw std::invalid_argument("Channel mixer coefficients must stay below 16384.");
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                matrix.coefficients[i][j] = static_cast<short>(std::lround(m[i][j] * (1 << matrix.shift)));
+            }
+        }
+        return matrix;
+    }
+    static Color_Matrix gray() {    // COLOR_BGR2GRAY's own coefficients in every row, the gray value written to all three channels
+        Color_Matrix matrix;
+        for (int i = 0; i < 3; i++) {
+            matrix.coefficients[i][0] = color_isolation_kernel::gray_b;
+            matrix.coefficients[i][1] = color_isolation_kernel::gray_g;
+            matrix.coefficients[i][2] = color_isolation_kernel::gray_r;
+        }
+        matrix.shift = color_isolation_kernel::gray_shift;
+        return matrix;
+    }
+};
+
+// One pass of a Color_Matrix over 8-bit BGR rows. Pixels are widened to int16 pairs (b, g) and (r, 1) so
+// each output channel is two multiply-adds against (m0, m1) and (m2, rounding), then shifted and
+// saturated. Every row function produces the same bytes as rowScalar.
+namespace color_matrix_kernel {
+    inline uchar clamp8(int value) {
+        return static_cast<uchar>(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+
+    inline void rowScalar(const uchar* src, uchar* dst, int width, const Color_Matrix& m) {
+        const int round = 1 << (m.shift - 1);
+        for (int x = 0; x < width; x++, src += 3, dst += 3) {
+            int b = src[0], g = src[1], r = src[2];
+            for (int i = 0; i < 3; i++) {
+                dst[i] = clamp8((b * m.coefficients[i][0] + g * m.coefficients[i][1] + r * m.coefficients[i][2] + round) >> m.shift);
+            }
+        }
+    }
+
+#ifdef IMAGECRAFT_X86
+    // Per 128-bit block of 4 pixels, as in color_isolation_kernel: 16 bytes are loaded and stored for 12.
+    inline int pairBg(const Color_Matrix& m, int i) {  // (m0, m1) as the low and high word of one madd lane
+        return (static_cast<unsigned short>(m.coefficients[i][1]) << 16) | static_cast<unsigned short>(m.coefficients[i][0]);
+    }
+    inline int pairR(const Color_Matrix& m, int i) {   // (m2, rounding), the rounding multiplies the constant 1
+        return ((1 << (m.shift - 1)) << 16) | static_cast<unsigned short>(m.coefficients[i][2]);
+    }
+
+    IMAGECRAFT_TARGET("sse4.1") void rowSse41(const uchar* src, uchar* dst, int width, const Color_Matrix& m) {
+        const __m128i bg_mask = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+        const __m128i r_mask = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+        const __m128i ones = _mm_set1_epi32(0x00010000);
+        const __m128i interleave = _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1);
+        const __m128i bg0 = _mm_set1_epi32(pairBg(m, 0)), bg1 = _mm_set1_epi32(pairBg(m, 1)), bg2 = _mm_set1_epi32(pairBg(m, 2));
+        const __m128i r0 = _mm_set1_epi32(pairR(m, 0)), r1 = _mm_set1_epi32(pairR(m, 1)), r2 = _mm_set1_epi32(pairR(m, 2));
+        const __m128i shift = _mm_cvtsi32_si128(m.shift);
+        int x = 0;
+        for (; x + 6 <= width; x += 4) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+            __m128i bg = _mm_shuffle_epi8(pixels, bg_mask);
+            __m128i r = _mm_or_si128(_mm_shuffle_epi8(pixels, r_mask), ones);
+            __m128i out0 = _mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(bg, bg0), _mm_madd_epi16(r, r0)), shift);
+            __m128i out1 = _mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(bg, bg1), _mm_madd_epi16(r, r1)), shift);
+            __m128i out2 = _mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(bg, bg2), _mm_madd_epi16(r, r2)), shift);
+            __m128i planar = _mm_packus_epi16(_mm_packs_epi32(out0, out1), _mm_packs_epi32(out2, out2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm_shuffle_epi8(planar, interleave));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, m);
+    }
+
+    IMAGECRAFT_TARGET("avx2") void rowAvx2(const uchar* src, uchar* dst, int width, const Color_Matrix& m) {
+        const __m256i bg_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1));
+        const __m256i r_mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1));
+        const __m256i ones = _mm256_set1_epi32(0x00010000);
+        const __m256i interleave = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1));
+        const __m256i bg0 = _mm256_set1_epi32(pairBg(m, 0)), bg1 = _mm256_set1_epi32(pairBg(m, 1)), bg2 = _mm256_set1_epi32(pairBg(m, 2));
+        const __m256i r0 = _mm256_set1_epi32(pairR(m, 0)), r1 = _mm256_set1_epi32(pairR(m, 1)), r2 = _mm256_set1_epi32(pairR(m, 2));
+        const __m128i shift = _mm_cvtsi32_si128(m.shift);
+        int x = 0;
+        for (; x + 10 <= width; x += 8) {
+            const uchar* p = src + 3 * x;
+            __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+            __m256i bg = _mm256_shuffle_epi8(pixels, bg_mask);
+            __m256i r = _mm256_or_si256(_mm256_shuffle_epi8(pixels, r_mask), ones);
+            __m256i out0 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_madd_epi16(bg, bg0), _mm256_madd_epi16(r, r0)), shift);
+            __m256i out1 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_madd_epi16(bg, bg1), _mm256_madd_epi16(r, r1)), shift);
+            __m256i out2 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_madd_epi16(bg, bg2), _mm256_madd_epi16(r, r2)), shift);
+            __m256i planar = _mm256_packus_epi16(_mm256_packs_epi32(out0, out1), _mm256_packs_epi32(out2, out2));
+            __m256i out = _mm256_shuffle_epi8(planar, interleave);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm256_castsi256_si128(out));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x + 12), _mm256_extracti128_si256(out, 1));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, m);
+    }
+
+    IMAGECRAFT_TARGET("avx512f,avx512bw") void rowAvx512(const uchar* src, uchar* dst, int width, const Color_Matrix& m) {
+        const __m512i bg_mask = _mm512_broadcast_i32x4(_mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1));
+        const __m512i r_mask = _mm512_broadcast_i32x4(_mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1));
+        const __m512i ones = _mm512_set1_epi32(0x00010000);
+        const __m512i interleave = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1));
+        const __m512i bg0 = _mm512_set1_epi32(pairBg(m, 0)), bg1 = _mm512_set1_epi32(pairBg(m, 1)), bg2 = _mm512_set1_epi32(pairBg(m, 2));
+        const __m512i r0 = _mm512_set1_epi32(pairR(m, 0)), r1 = _mm512_set1_epi32(pairR(m, 1)), r2 = _mm512_set1_epi32(pairR(m, 2));
+        const __m128i shift = _mm_cvtsi32_si128(m.shift);
+        int x = 0;
+        for (; x + 18 <= width; x += 16) {
+            const uchar* p = src + 3 * x;
+            __m512i pixels = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 24)), 2);
+            pixels = _mm512_inserti32x4(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 36)), 3);
+            __m512i bg = _mm512_shuffle_epi8(pixels, bg_mask);
+            __m512i r = _mm512_or_si512(_mm512_shuffle_epi8(pixels, r_mask), ones);
+            __m512i out0 = _mm512_sra_epi32(_mm512_add_epi32(_mm512_madd_epi16(bg, bg0), _mm512_madd_epi16(r, r0)), shift);
+            __m512i out1 = _mm512_sra_epi32(_mm512_add_epi32(_mm512_madd_epi16(bg, bg1), _mm512_madd_epi16(r, r1)), shift);
+            __m512i out2 = _mm512_sra_epi32(_mm512_add_epi32(_mm512_madd_epi16(bg, bg2), _mm512_madd_epi16(r, r2)), shift);
+            __m512i planar = _mm512_packus_epi16(_mm512_packs_epi32(out0, out1), _mm512_packs_epi32(out2, out2));
+            __m512i out = _mm512_shuffle_epi8(planar, interleave);
+            uchar* q = dst + 3 * x;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q), _mm512_castsi512_si128(out));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 12), _mm512_extracti32x4_epi32(out, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 24), _mm512_extracti32x4_epi32(out, 2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 36), _mm512_extracti32x4_epi32(out, 3));
+        }
+        rowScalar(src + 3 * x, dst + 3 * x, width - x, m);
+    }
+#endif
+
+    typedef void (*Row)(const uchar* src, uchar* dst, int width, const Color_Matrix& m);
+    inline Row selectRow() {
+#ifdef IMAGECRAFT_X86
+        if (checkHardwareSupport(CV_CPU_AVX_512BW)) {
+            return rowAvx512;
+        }
+        if (checkHardwareSupport(CV_CPU_AVX2)) {
+            return rowAvx2;
+        }
+        if (checkHardwareSupport(CV_CPU_SSE4_1)) {
+            return rowSse41;
+        }
+#endif
+        return rowScalar;
+    }
+}
+
+class Blur_Engine {     // blur and sharpen whose cost per pixel does not grow with the slider value
+public:
+    // From sigma 2 (slider value 5) up, three stacked box filters replace the Gaussian. cv::blur keeps running
+    // sums, so every pass costs the same at any radius. Over the whole slider range the result stays within
+    // 1 level mean and 5 levels max absolute difference of GaussianBlur with the slider's kernel size.
+    static constexpr double box_sigma = 2.0;
+
+    static double sliderSigma(int value) {  // sigma OpenCV derives from the (2 * value + 1) kernel of the blur slider
+        int kernel_size = value * 2 + 1;
+        return 0.3 * ((kernel_size - 1) * 0.5 - 1) + 0.8;
+    }
+    static Mat gaussian(const Mat& img, double sigma, int kernel_size = 0) {   // kernel_size 0 derives it from sigma
+        Mat result;
+        if (sigma < box_sigma) {
+            GaussianBlur(img, result, Size(kernel_size, kernel_size), sigma);   // small kernels are cheapest as they are
+            return result;
+        }
+        Mat pass;
+        vector<int> widths = boxWidths(sigma);
+        blur(img, result, Size(widths[0], widths[0]));
+        blur(result, pass, Size(widths[1], widths[1]));
+        blur(pass, result, Size(widths[2], widths[2]));
+        return result;
+    }
+    static int radius(double sigma, int kernel_size = 0) {     // pixels gaussian() reads on each side
+        if (sigma < box_sigma) {
+            return (kernel_size > 0 ? kernel_size : (cvRound(sigma * 3 * 2 + 1) | 1)) / 2;
+        }
+        int total = 0;
+        for (int width : boxWidths(sigma)) {
+            total += width / 2;
+        }
+        return total;
+    }
+    static Mat sharpen(const Mat& img, float amount) {     // img + amount * (4 * img - its 4 neighbours), one pass
+        if (img.depth() != CV_8U) {
+            Mat kernel = (Mat_<float>(3, 3) << 0, -amount, 0, -amount, 1 + 4 * amount, -amount, 0, -amount, 0);
+            Mat result;
+            filter2D(img, result, -1, kernel);
+            return result;
+        }
+        Mat result(img.size(), img.type());
+        const int cn = img.channels();
+        const int width = img.cols * cn;
+        const int weight = cvRound(amount * 256);  // 8 fractional bits
+        parallel_for_(Range(0, img.rows), [&](const Range& rows) {
+            for (int y = rows.start; y < rows.end; y++) {
+                const uchar* c = img.ptr<uchar>(y);   // borders reflect like filter2D's BORDER_REFLECT_101
+                const uchar* up = img.ptr<uchar>(y > 0 ? y - 1 : min(1, img.rows - 1));
+                const uchar* down = img.ptr<uchar>(y + 1 < img.rows ? y + 1 : max(img.rows - 2, 0));
+                uchar* out = result.ptr<uchar>(y);
+                auto edge = [&](int x) {
+                    int left = x >= cn ? c[x - cn] : (x + cn < width ? c[x + cn] : c[x]);
+                    int right = x + cn < width ? c[x + cn] : (x >= cn ? c[x - cn] : c[x]);
+                    int detail = 4 * c[x] - up[x] - down[x] - left - right;
+                    out[x] = saturate_cast<uchar>(c[x] + ((detail * weight + 128) >> 8));
+                };
+                int x = 0;
+                for (; x < min(cn, width); x++) {
+                    edge(x);
+                }
+                for (; x < width - cn; x++) {     // branch-free middle, the compiler vectorizes it
+                    int detail = 4 * c[x] - up[x] - down[x] - c[x - cn] - c[x + cn];
+                    out[x] = saturate_cast<uchar>(c[x] + ((detail * weight + 128) >> 8));
+                }
+                for (; x < width; x++) {
+                    edge(x);
+                }
+            }
+        });
+        return result;
+    }
+
+private:
+    static vector<int> boxWidths(double sigma) {   // three odd box widths whose stacked variance matches sigma
+        const int passes = 3;
+        int lower = static_cast<int>(floor(sqrt(12 * sigma * sigma / passes + 1)));
+        if (lower % 2 == 0) {
+            lower--;
+        }
+        int narrow = cvRound((12 * sigma * sigma - passes * lower * lower - 4 * passes * lower - 3 * passes) / (-4.0 * lower - 4));
+        vector<int> widths(passes);
+        for (int i = 0; i < passes; i++) {
+            widths[i] = i < narrow ? lower : lower + 2;
+        }
+        return widths;
+    }
 };
+
 class Image_Filters {       // handles filter and enhancements
 public:
     Mat brightness_adjustment(Mat& img, int value) {
+        IMAGECRAFT_TRACE("Image_Filters::brightness_adjustment");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot adjust brightness.");
         }
         else {
-            Mat return_image;
-            img.convertTo(return_image, -1, 1, value);      // data type, scaling factor contrast, brightness offset
-            return return_image;
+            return Point_Op_Chain().brightness(value).apply(img);      // brightness offset added to every channel
         }
     }
     Mat contrast_adjustment(Mat& img, int value) {
+        IMAGECRAFT_TRACE("Image_Filters::contrast_adjustment");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot adjust contrast.");
         }
         else {
-            Mat return_image;
-            double alpha = 1 + (value / 100.0);     // maps slider value (-100 to 100) to a scaling factor (0-2)
-            img.convertTo(return_image, -1, alpha, 0); // alpha is the contrast scaling factor, 0 is the brightness offset
-            return return_image;
+            return Point_Op_Chain().contrast(value).apply(img);    // scales every channel by 1 + value / 100
+        }
+    }
+    Mat point_operations(Mat& img, const Point_Op_Chain& ops) {    // any chain of point edits costs one pass
+        IMAGECRAFT_TRACE("Image_Filters::point_operations");
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot apply point operations.");
         }
+        return ops.apply(img);
     }
-    Mat blur_adjustment(Mat& img, int value) {
+    Mat blur_adjustment(Mat& img, int value, double scale = 1.0) {     // scale < 1 renders the same look on a downsampled proxy
+        IMAGECRAFT_TRACE("Image_Filters::blur_adjustment");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot adjust sharpness.");
         }
@@ -83,20 +854,24 @@ public:
             Mat blur_image;
             if (value > 0) {        // blur
                 int kernel_size = value * 2 + 1;        // size must be odd
-                GaussianBlur(img, blur_image, Size(kernel_size, kernel_size), 0); //input, output, dimension, standard deviation
+                double sigma = Blur_Engine::sliderSigma(value);
+                if (scale < 1.0) {
+                    blur_image = Blur_Engine::gaussian(img, sigma * scale);    // same blur measured in proxy pixels
+                }
+                else {
+                    blur_image = Blur_Engine::gaussian(img, sigma, kernel_size);
+                }
             }
             else if (value < 0) {       // sharpen
-                float k = abs(value) / 50;              // scaling factor for intensity
-                Mat kernel = (Mat_<float>(3, 3) <<
-                    0, -k, 0,
-                    -k, 1 + 4 * k, -k, // central pixel and neighbouring pixels to enhance edge
-                    0, -k, 0);
-                filter2D(img, blur_image, -1, kernel);      // applies kernel to output image
+                float k = abs(value) / 50.0f;           // scaling factor for intensity
+                k *= static_cast<float>(min(scale, 1.0));   // sharpening is a pixel-scale effect, weaken it on the proxy
+                blur_image = Blur_Engine::sharpen(img, k);  // central pixel and neighbouring pixels to enhance edge
             }
             return blur_image;
         }
     }
     Mat gray_filter(Mat& img) {
+        IMAGECRAFT_TRACE("Image_Filters::gray_filter");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot adjust sharpness.");
         }
@@ -106,27 +881,61 @@ public:
             return gray_image;
         }
     }
+    Mat gray_bgr_filter(Mat& img) {     // grayscale kept in three channels, one pass instead of gray_filter + COLOR_GRAY2BGR
+        IMAGECRAFT_TRACE("Image_Filters::gray_bgr_filter");
+        if (img.type() != CV_8UC3) {
+            Mat gray_image = gray_filter(img);
+            cvtColor(gray_image, gray_image, COLOR_GRAY2BGR);
+            return gray_image;
+        }
+        static const Color_Matrix gray = Color_Matrix::gray();
+        return channel_mixer(img, gray);
+    }
     Mat sepia_filter(Mat& img) {
+        IMAGECRAFT_TRACE("Image_Filters::sepia_filter");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot adjust sharpness.");
         }
         else {
+            static const float sepia[3][3] = {
+                { 0.272f, 0.534f, 0.131f },
+                { 0.349f, 0.686f, 0.168f },     // transformation matrix for sepia effect
+                { 0.393f, 0.769f, 0.189f },
+            };
+            if (img.type() == CV_8UC3) {
+                static const Color_Matrix matrix = Color_Matrix::fromFloat(sepia);
+                return channel_mixer(img, matrix);  // within one level of the float transform below
+            }
             Mat sepia_image;
-            Mat kernel = (cv::Mat_<float>(3, 3) <<
-                0.272, 0.534, 0.131,
-                0.349, 0.686, 0.168,                // transformation matrix for sepia effect
-                0.393, 0.769, 0.189);
-            transform(img, sepia_image, kernel);        // applies transformation to input image
+            transform(img, sepia_image, Mat(3, 3, CV_32F, const_cast<float*>(&sepia[0][0])));   // applies transformation to input image
             return sepia_image;
         }
     }
+    Mat channel_mixer(Mat& img, const Color_Matrix& matrix) {  // any 3x3 mix of the B, G and R channels in one pass
+        IMAGECRAFT_TRACE("Image_Filters::channel_mixer");
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot mix channels.");
+        }
+        if (img.type() != CV_8UC3) {
+            throw std::runtime_error("Channel mixing needs an 8-bit BGR image.");
+        }
+        static const color_matrix_kernel::Row row = color_matrix_kernel::selectRow();
+        Mat result(img.size(), CV_8UC3);
+        parallel_for_(Range(0, img.rows), [&](const Range& rows) {
+            for (int y = rows.start; y < rows.end; y++) {
+                row(img.ptr<uchar>(y), result.ptr<uchar>(y), img.cols, matrix);
+            }
+        });
+        return result;
+    }
     Mat color_inversion(Mat& img) {
+        IMAGECRAFT_TRACE("Image_Filters::color_inversion");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot invert colors.");
         }
         Mat inverted_img;
         if (img.channels() == 1 || img.channels() == 3 || img.channels() == 4) {    // throw error if channels not allowed
-            bitwise_not(img, inverted_img);         // converts each pixel to its inverse i.e, 255 to 0, 0 to 255
+            Point_Op_Chain().invert().apply(img, inverted_img);     // converts each pixel to its inverse i.e, 255 to 0, 0 to 255
         }
         else {
             throw runtime_error("Invalid number of channels in the image.");
@@ -139,86 +948,3357 @@ public:
     }
 
     Mat color_isolation(Mat& img, int color) {
+        IMAGECRAFT_TRACE("Image_Filters::color_isolation");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot isolate color.");
         }
-        Mat hsv;
-        cvtColor(img, hsv, COLOR_BGR2HSV);      // hsv format more suitable for color based operations
-
-        Mat mask;
-
-        if (color == 0) {
-            // Red can wrap around the hue values in HSV, so we need to consider two ranges
-            Mat lower_red_mask, upper_red_mask;
-            inRange(hsv, Scalar(0, 100, 100), Scalar(10, 255, 255), lower_red_mask);
-            inRange(hsv, Scalar(170, 100, 100), Scalar(180, 255, 255), upper_red_mask);
-            mask = lower_red_mask | upper_red_mask;
-        }
-        else if (color == 1) { // Green
-            inRange(hsv, Scalar(35, 50, 50), Scalar(85, 255, 255), mask);
-        }
-        else if (color == 2) { // Blue
-            inRange(hsv, Scalar(100, 150, 80), Scalar(140, 255, 255), mask);
-        }
-        else if (color == 3) { // Yellow
-            inRange(hsv, Scalar(20, 150, 150), Scalar(30, 255, 255), mask);
-        }
-        else {
+        static const Hsv_Window windows[4] = {     // hsv format more suitable for color based operations
+            { { 0, 170 }, { 10, 180 }, 100, 100 },  // Red can wrap around the hue values in HSV, so we need to consider two ranges
+            { { 35, 1 }, { 85, 0 }, 50, 50 },       // Green
+            { { 100, 1 }, { 140, 0 }, 150, 80 },    // Blue
+            { { 20, 1 }, { 30, 0 }, 150, 150 },     // Yellow
+        };
+        if (color < 0 || color > 3) {
             throw std::invalid_argument("Invalid color value. Use 0 for Red, 1 for Green, or 2 for Blue.");
         }
-
-        Mat gray;
-        cvtColor(img, gray, COLOR_BGR2GRAY);        // convert image to gray
-        Mat gray_bgr;
-        cvtColor(gray, gray_bgr, COLOR_GRAY2BGR);   // convert the grayscale image back to BGR to fix channel issue
-
-        Mat result = gray_bgr.clone(); // Create the final image by combining color and grayscale images using the mask
-        img.copyTo(result, mask);        // Copy the color 
-
+        if (img.type() != CV_8UC3) {
+            throw std::runtime_error("Color isolation needs an 8-bit BGR image.");
+        }
+        static const color_isolation_kernel::Row row = color_isolation_kernel::selectRow();
+        const Hsv_Window& window = windows[color];
+        Mat result(img.size(), CV_8UC3);    // colour where the window matches, gray everywhere else
+        parallel_for_(Range(0, img.rows), [&](const Range& rows) {
+            for (int y = rows.start; y < rows.end; y++) {
+                row(img.ptr<uchar>(y), result.ptr<uchar>(y), img.cols, window);
+            }
+        });
         return result;
     }
 };
 class Image_Operations {    // handles general operations
 public:
     Mat resizeImage(Mat& img, int value) {
+        IMAGECRAFT_TRACE("Image_Operations::resizeImage");
         if (img.empty()) {
             throw std::runtime_error("Image is empty, cannot resize.");
         }
-        double scale = value / 100.0;       // Calculate the scaling factor as a number from 0 to 1
-        Mat resizedImg;
-        resize(img, resizedImg, Size(), scale, scale);
-        return resizedImg;
+        double scale = value / 100.0;       // Calculate the scaling factor as a number from 0 to 1
+        Mat resizedImg;
+        resize(img, resizedImg, Size(), scale, scale, scale < 1.0 ? INTER_AREA : INTER_LINEAR);    // bilinear skips source pixels and aliases when shrinking
+        return resizedImg;
+    }
+    Mat rotateimage(Mat& img, int state) {
+        IMAGECRAFT_TRACE("Image_Operations::rotateimage");
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot rotate.");
+        }
+        Mat rotatedImg;
+        if (state == 1) {   // clockwise state
+            rotate(img, rotatedImg, ROTATE_90_CLOCKWISE);
+        }
+        else if (state == -1) {     // anticlockwise state
+            rotate(img, rotatedImg, ROTATE_90_COUNTERCLOCKWISE);
+        }
+        return rotatedImg;
+    }
+    Mat flipimage(Mat& img, int state) {
+        IMAGECRAFT_TRACE("Image_Operations::flipimage");
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot flip.");
+        }
+        Mat flippedImg;
+        if (state == -1) {
+            flip(img, flippedImg, 0);       // flip vertically
+        }
+        else if (state == 1) {
+            flip(img, flippedImg, 1);       // flip horizontally
+        }
+        return flippedImg;
+    }
+    Mat previewProxy(const Mat& img, int max_width, int max_height, double& scale) {   // display-sized copy for interactive previews
+        IMAGECRAFT_TRACE("Image_Operations::previewProxy");
+        if (img.empty()) {
+            throw std::runtime_error("Image is empty, cannot create preview.");
+        }
+        scale = min(1.0, min(static_cast<double>(max_width) / img.cols, static_cast<double>(max_height) / img.rows));
+        if (scale >= 1.0) {
+            return img;     // already small enough to preview at full resolution
+        }
+        Mat proxy;
+        resize(img, proxy, Size(max(1, cvRound(img.cols * scale)), max(1, cvRound(img.rows * scale))), 0, 0, INTER_AREA);
+        return proxy;
+    }
+};
+
+class Mip_Pyramid {     // the image at every halving, a scale is served from the nearest level that is not smaller
+public:
+    void build(const Mat& img) {
+        levels.assign(1, img);      // level 0 shares the full resolution pixels
+        while (levels.back().cols >= 2 && levels.back().rows >= 2) {
+            Mat half;
+            cv::resize(levels.back(), half, Size(levels.back().cols / 2, levels.back().rows / 2), 0, 0, INTER_AREA);
+            levels.push_back(half);
+        }
+    }
+    void release() {
+        levels.clear();
+    }
+    bool empty() const {
+        return levels.empty();
+    }
+    Mat at(double scale) const {    // level 0 resized by scale, reading at most twice the output's pixels
+        IMAGECRAFT_TRACE("Mip_Pyramid::at");
+        if (levels.empty()) {
+            throw std::runtime_error("Image pyramid is empty, cannot resize.");
+        }
+        Size target(max(1, cvRound(levels[0].cols * scale)), max(1, cvRound(levels[0].rows * scale)));
+        size_t level = 0;
+        while (level + 1 < levels.size() && levels[level + 1].cols >= target.width && levels[level + 1].rows >= target.height) {
+            level++;
+        }
+        if (levels[level].size() == target) {
+            return levels[level];
+        }
+        Mat resized;
+        cv::resize(levels[level], resized, target, 0, 0, scale < 1.0 ? INTER_AREA : INTER_LINEAR);
+        return resized;
+    }
+
+private:
+    vector<Mat> levels;     // each half the size of the one before, down to a single row or column
+};
+
+// Slider ticks and batch files produce frames of the same few sizes over and over. Freed frames are kept in
+// free lists per size class and handed to the next Mat or QImage of that class, so once the sizes in use
+// have been seen the pool serves every frame without touching the heap. Classes are a quarter of a power
+// of two apart, a frame may get up to 25% more memory than it asked for.
+class Frame_Pool : public MatAllocator {
+public:
+    static Frame_Pool& instance() {     // never destroyed, Mats held by globals are released after main returns
+        static Frame_Pool* pool = new Frame_Pool();
+        return *pool;
+    }
+
+    void* take(size_t bytes) {      // 64-byte aligned like fastMalloc
+        size_t size = sizeClass(bytes);
+        if (size >= min_pooled) {
+            lock_guard<std::mutex> lock(guard);
+            vector<uchar*>& blocks = free_lists[size];
+            if (!blocks.empty()) {
+                uchar* block = blocks.back();
+                blocks.pop_back();
+                cached -= size;
+                hit_count++;
+                return block + header;
+            }
+            miss_count++;
+        }
+        uchar* block = static_cast<uchar*>(fastMalloc(size + header));
+        *reinterpret_cast<size_t*>(block) = size;   // give() reads the class back from here
+        return block + header;
+    }
+    void give(void* data) {
+        if (!data) {
+            return;
+        }
+        uchar* block = static_cast<uchar*>(data) - header;
+        size_t size = *reinterpret_cast<size_t*>(block);
+        if (size >= min_pooled && size <= budget) {
+            lock_guard<std::mutex> lock(guard);
+            while (cached + size > budget) {
+                evictLargest();     // sizes no longer in use make room for the ones that are
+            }
+            free_lists[size].push_back(block);
+            cached += size;
+            return;
+        }
+        fastFree(block);
+    }
+    QImage image(int width, int height, QImage::Format format, int bytes_per_pixel) {   // pixels come from the pool and go back when the last copy is gone
+        int bytes_per_line = (width * bytes_per_pixel + 3) & ~3;    // QImage rows are 32-bit aligned
+        void* data = take(static_cast<size_t>(bytes_per_line) * height);
+        return QImage(static_cast<uchar*>(data), width, height, bytes_per_line, format, [](void* pixels) { instance().give(pixels); }, data);
+    }
+
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, AccessFlag, UMatUsageFlags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--) {   // same layout as the standard allocator
+            if (step) {
+                if (data && step[i] != CV_AUTOSTEP) {
+                    total = step[i];
+                }
+                else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+        UMatData* u = new UMatData(this);   // the small header still comes from the heap
+        u->data = u->origdata = data ? static_cast<uchar*>(data) : static_cast<uchar*>(const_cast<Frame_Pool*>(this)->take(total));
+        u->size = total;
+        if (data) {
+            u->flags |= UMatData::USER_ALLOCATED;
+        }
+        return u;
+    }
+    bool allocate(UMatData* data, AccessFlag, UMatUsageFlags) const override {
+        return data != nullptr;
+    }
+    void deallocate(UMatData* u) const override {
+        if (!u) {
+            return;
+        }
+        CV_Assert(u->urefcount == 0 && u->refcount == 0);
+        if (!(u->flags & UMatData::USER_ALLOCATED)) {
+            const_cast<Frame_Pool*>(this)->give(u->origdata);
+        }
+        delete u;
+    }
+
+    void trim(size_t keep_bytes) {      // frees cached blocks, largest classes first, until at most keep_bytes stay
+        lock_guard<std::mutex> lock(guard);
+        while (cached > keep_bytes) {
+            evictLargest();
+        }
+    }
+
+    long long hits() const { return hit_count; }
+    long long misses() const { return miss_count; }     // frame-sized requests that went to the heap
+    size_t cachedBytes() const { return cached; }
+
+private:
+    Frame_Pool() {
+        if (const char* mb = getenv("IMAGECRAFT_POOL_MB")) {
+            budget = strtoull(mb, nullptr, 10) * 1024 * 1024;
+        }
+    }
+    static size_t sizeClass(size_t bytes) {
+        if (bytes < min_pooled) {
+            return (bytes + 63) & ~size_t(63);
+        }
+        size_t power = 1;
+        while (power * 2 <= bytes) {
+            power *= 2;
+        }
+        size_t step = power / 4;
+        return (bytes + step - 1) / step * step;
+    }
+    void evictLargest() {   // frees the cached blocks of the class holding the most bytes
+        auto largest = free_lists.end();
+        for (auto it = free_lists.begin(); it != free_lists.end(); ++it) {
+            if (!it->second.empty() && (largest == free_lists.end() || it->first * it->second.size() > largest->first * largest->second.size())) {
+                largest = it;
+            }
+        }
+        for (uchar* block : largest->second) {
+            fastFree(block);
+        }
+        cached -= largest->first * largest->second.size();
+        largest->second.clear();
+    }
+
+    static const size_t header = 64;            // keeps the pixels 64-byte aligned
+    static const size_t min_pooled = 64 * 1024; // smaller buffers are not frames, malloc serves them well
+    std::mutex guard;
+    std::map<size_t, vector<uchar*>> free_lists;    // size class -> free blocks, std:: because MatAllocator::map hides it
+    std::atomic<size_t> cached{ 0 };    // changed under guard, read without it by cachedBytes()
+    size_t budget = size_t(256) * 1024 * 1024;  // IMAGECRAFT_POOL_MB
+    std::atomic<long long> hit_count{ 0 }, miss_count{ 0 };
+};
+
+class Allocator_Scope {     // default Mat allocator until the end of the enclosing scope, also when it is left by an exception
+public:
+    explicit Allocator_Scope(MatAllocator* allocator) : previous(Mat::getDefaultAllocator()) {
+        Mat::setDefaultAllocator(allocator);
+    }
+    ~Allocator_Scope() {
+        Mat::setDefaultAllocator(previous);
+    }
+    Allocator_Scope(const Allocator_Scope&) = delete;
+    Allocator_Scope& operator=(const Allocator_Scope&) = delete;
+
+private:
+    MatAllocator* previous;
+};
+
+class Display_Surface {    // persistent display-sized BGR buffers, images are scaled straight into them
+public:
+    QImage present(const Mat& img, int max_width, int max_height) {    // fits img inside max_width x max_height keeping its aspect ratio
+        IMAGECRAFT_TRACE("Display_Surface::present");
+        if (img.empty() || max_width <= 0 || max_height <= 0) {
+            throw std::runtime_error("Image is empty, cannot display.");
+        }
+        double scale = min(static_cast<double>(max_width) / img.cols, static_cast<double>(max_height) / img.rows);
+        Size size(max(1, cvRound(img.cols * scale)), max(1, cvRound(img.rows * scale)));
+        QImage& buffer = buffers[next];
+        next ^= 1;      // the other buffer may still be on its way to the label
+        if (buffer.width() != size.width || buffer.height() != size.height) {
+            buffer = Frame_Pool::instance().image(size.width, size.height, QImage::Format_BGR888, 3);   // same byte order as Mat, no swizzle
+        }
+        Mat target(size, CV_8UC3, buffer.bits(), buffer.bytesPerLine());   // bits() only copies if a shown frame still shares it
+        Mat scaled = img;
+        if (size != img.size()) {
+            if (img.type() == CV_8UC3) {
+                scaled = target;    // scale directly into the buffer
+            }
+            cv::resize(img, scaled, size, 0, 0, scale < 1.0 ? INTER_AREA : INTER_LINEAR);
+        }
+        if (img.channels() == 1) {
+            cvtColor(scaled, target, COLOR_GRAY2BGR);
+        }
+        else if (img.channels() == 4) {
+            cvtColor(scaled, target, COLOR_BGRA2BGR);
+        }
+        else if (scaled.data != target.data) {
+            scaled.copyTo(target);
+        }
+        return buffer;
+    }
+
+private:
+    QImage buffers[2];
+    int next = 0;
+};
+
+// Zoom and pan through a cache of fixed-size tiles at power-of-two levels, level L holding the image scaled by
+// 1/2^L. A frame reads the finest level that is not larger than the screen needs and only the tiles under the
+// visible rectangle, so looking at a detail of a 100 MP image costs about a screen's worth of pixels.
+class Tile_Viewport {
+public:
+    static const int tile_size = 256;
+
+    Tile_Viewport() {
+        if (const char* budget = getenv("IMAGECRAFT_TILE_CACHE_MB")) {
+            cache_budget = strtoull(budget, nullptr, 10) * 1024 * 1024;
+        }
+    }
+    void setImage(const Mat& img) {     // every tile is stale, zoom and pan survive while the size does
+        if (img.size() != source.size()) {
+            zoom = 0;
+        }
+        source = img;
+        tiles.clear();
+        recency.clear();
+        cached = 0;
+    }
+    void fit() {
+        zoom = 0;
+    }
+    bool zoomed() const {
+        return zoom > 0;
+    }
+    double scale(Size view) const {     // display pixels per image pixel
+        return zoom > 0 ? zoom : fitScale(view);
+    }
+    // offsets are in display pixels from the middle of the view, where the frame is centered
+    Point2d toImage(Point2d offset, Size view) const {
+        return currentCenter() + offset * (1.0 / scale(view));
+    }
+    Point2d fromImage(Point2d point, Size view) const {     // inverse of toImage()
+        return (point - currentCenter()) * scale(view);
+    }
+    void zoomAt(double factor, Point2d offset, Size view) {    // the image point under offset stays in place
+        Point2d anchor = toImage(offset, view);
+        double next = min(scale(view) * factor, 32.0);
+        if (next <= fitScale(view)) {
+            zoom = 0;
+            return;
+        }
+        zoom = next;
+        center = anchor - offset * (1.0 / zoom);
+    }
+    void pan(Point2d moved) {    // moved in display pixels, the image follows the cursor
+        if (zoom > 0) {
+            center -= moved * (1.0 / zoom);
+        }
+    }
+
+    QImage render(Size view) {
+        IMAGECRAFT_TRACE("Tile_Viewport::render");
+        if (source.empty() || view.width <= 0 || view.height <= 0) {
+            throw std::runtime_error("Image is empty, cannot display.");
+        }
+        double s = scale(view);
+        Size frame(min(view.width, max(1, cvRound(source.cols * s))), min(view.height, max(1, cvRound(source.rows * s))));
+        center = currentCenter();
+        double half_width = frame.width / (2 * s), half_height = frame.height / (2 * s);
+        center.x = min(max(center.x, half_width), source.cols - half_width);   // no empty margin while the image is larger than the view
+        center.y = min(max(center.y, half_height), source.rows - half_height);
+        Point2d origin(center.x - half_width, center.y - half_height);
+
+        int level = 0;
+        while (level < 16 && s * (2 << level) <= 1.0) {
+            level++;
+        }
+        double level_scale = 1.0 / (1 << level);
+        Size level_size((source.cols + (1 << level) - 1) >> level, (source.rows + (1 << level) - 1) >> level);
+        int x0 = max(0, static_cast<int>(floor(origin.x * level_scale))), y0 = max(0, static_cast<int>(floor(origin.y * level_scale)));
+        int x1 = min(level_size.width, static_cast<int>(ceil((origin.x + 2 * half_width) * level_scale)) + 1);
+        int y1 = min(level_size.height, static_cast<int>(ceil((origin.y + 2 * half_height) * level_scale)) + 1);
+        int tx0 = x0 / tile_size, ty0 = y0 / tile_size, tx1 = (x1 - 1) / tile_size, ty1 = (y1 - 1) / tile_size;
+
+        Mat mosaic;     // the visible tiles side by side, a single tile is used in place
+        Point mosaic_origin(tx0 * tile_size, ty0 * tile_size);
+        if (tx0 == tx1 && ty0 == ty1) {
+            mosaic = tile(level, tx0, ty0);
+        }
+        else {
+            mosaic.create(min(level_size.height, (ty1 + 1) * tile_size) - mosaic_origin.y, min(level_size.width, (tx1 + 1) * tile_size) - mosaic_origin.x, CV_8UC3);
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++) {
+                    Mat pixels = tile(level, tx, ty);
+                    pixels.copyTo(mosaic(Rect(tx * tile_size - mosaic_origin.x, ty * tile_size - mosaic_origin.y, pixels.cols, pixels.rows)));
+                }
+            }
+        }
+
+        QImage& buffer = buffers[next];
+        next ^= 1;      // the other buffer may still be on its way to the label
+        if (buffer.width() != frame.width || buffer.height() != frame.height) {
+            buffer = Frame_Pool::instance().image(frame.width, frame.height, QImage::Format_BGR888, 3);
+        }
+        Mat target(frame, CV_8UC3, buffer.bits(), buffer.bytesPerLine());
+        if (zoom == 0) {    // the whole level is visible, area averaging keeps the fitted frame free of aliasing
+            cv::resize(mosaic, target, frame, 0, 0, INTER_AREA);
+            return buffer;
+        }
+        // display pixel centre u + 0.5 lies at image x origin.x + (u + 0.5) / s, and at that level's pixel index x * level_scale - 0.5
+        double step = level_scale / s;
+        double mapping[] = { step, 0, (origin.x + 0.5 / s) * level_scale - 0.5 - mosaic_origin.x,
+                             0, step, (origin.y + 0.5 / s) * level_scale - 0.5 - mosaic_origin.y };
+        warpAffine(mosaic, target, Mat(2, 3, CV_64F, mapping), frame, (s >= 2 ? INTER_NEAREST : INTER_LINEAR) | WARP_INVERSE_MAP, BORDER_REPLICATE);    // enlarged pixels stay sharp squares
+        return buffer;
+    }
+    long long tileHits() const { return hit_count; }
+    long long tileMisses() const { return miss_count; }
+    size_t cachedBytes() const { return cached; }
+
+private:
+    double fitScale(Size view) const {
+        return source.empty() ? 1.0 : min(static_cast<double>(view.width) / source.cols, static_cast<double>(view.height) / source.rows);
+    }
+    Point2d currentCenter() const {
+        return zoom > 0 ? center : Point2d(source.cols / 2.0, source.rows / 2.0);
+    }
+    Mat tile(int level, int tx, int ty) {      // BGR pixels of one tile, scaled from the source on a miss
+        uint64 key = (static_cast<uint64>(level) << 48) | (static_cast<uint64>(ty) << 24) | static_cast<uint64>(tx);
+        auto found = tiles.find(key);
+        if (found != tiles.end()) {
+            recency.splice(recency.begin(), recency, found->second.position);   // most recently used first
+            hit_count++;
+            return found->second.pixels;
+        }
+        miss_count++;
+        int span = tile_size << level;
+        Rect region = Rect(tx * span, ty * span, span, span) & Rect(0, 0, source.cols, source.rows);
+        Mat scaled = source(region);
+        if (level > 0) {
+            cv::resize(scaled, scaled, Size((region.width + (1 << level) - 1) >> level, (region.height + (1 << level) - 1) >> level), 0, 0, INTER_AREA);
+        }
+        Mat pixels = scaled;    // a full resolution colour tile is a view of the source and costs nothing
+        if (scaled.channels() == 1) {
+            cvtColor(scaled, pixels, COLOR_GRAY2BGR);
+        }
+        else if (scaled.channels() == 4) {
+            cvtColor(scaled, pixels, COLOR_BGRA2BGR);
+        }
+        Tile entry;
+        entry.pixels = pixels;
+        entry.bytes = pixels.data == scaled.data && level == 0 ? 0 : pixels.total() * pixels.elemSize();
+        recency.push_front(key);
+        entry.position = recency.begin();
+        cached += entry.bytes;
+        tiles[key] = entry;
+        while (cached > cache_budget && recency.size() > 1) {   // least recently used first, never the tile just made
+            auto oldest = tiles.find(recency.back());
+            cached -= oldest->second.bytes;
+            tiles.erase(oldest);
+            recency.pop_back();
+        }
+        return pixels;
+    }
+
+    struct Tile {
+        Mat pixels;
+        size_t bytes = 0;
+        std::list<uint64>::iterator position;
+    };
+    Mat source;
+    double zoom = 0;        // display pixels per image pixel, 0 fits the whole image in the view
+    Point2d center;         // image point in the middle of the view while zoomed
+    std::map<uint64, Tile> tiles;   // level, row and column packed into one key
+    std::list<uint64> recency;
+    size_t cached = 0;
+    size_t cache_budget = size_t(64) * 1024 * 1024;    // IMAGECRAFT_TILE_CACHE_MB
+    long long hit_count = 0, miss_count = 0;
+    QImage buffers[2];
+    int next = 0;
+};
+
+// Crop selection and placement guides on their own transparent widget above the preview label. Each change
+// invalidates only the old and new outlines, the label's pixels under them come from the backing store, so a
+// rubber band drag costs the strip it sweeps rather than a repaint of the window.
+class Overlay_Layer : public QWidget {
+public:
+    explicit Overlay_Layer(QWidget* parent) : QWidget(parent) {
+        setAttribute(Qt::WA_TransparentForMouseEvents);    // presses still reach the window for selection and panning
+        setAttribute(Qt::WA_NoSystemBackground);
+    }
+    void setSelection(const QRect& rect) {
+        if (rect != selection) {
+            update(outline(selection).united(outline(rect)));
+            selection = rect;
+        }
+    }
+    void setGuides(const vector<QRect>& rects) {
+        QRect dirty;
+        for (const QRect& rect : guides) {
+            dirty = dirty.united(outline(rect));
+        }
+        for (const QRect& rect : rects) {
+            dirty = dirty.united(outline(rect));
+        }
+        guides = rects;
+        update(dirty);
+    }
+
+protected:
+    void paintEvent(QPaintEvent* event) override {     // Qt clips to the invalidated region
+        QPainter painter(this);
+        for (const QRect& rect : guides) {
+            if (rect.intersects(event->rect())) {
+                painter.setPen(QPen(Qt::yellow, 1, Qt::DotLine));
+                painter.setBrush(Qt::NoBrush);
+                painter.drawRect(rect);
+            }
+        }
+        if (!selection.isNull() && outline(selection).intersects(event->rect())) {
+            painter.setPen(QPen(Qt::red, 2, Qt::DashLine));
+            painter.setBrush(QBrush(QColor(255, 0, 0, 50))); // Transparent red
+            painter.drawRect(selection);
+        }
+    }
+
+private:
+    static QRect outline(const QRect& rect) {   // the rectangle and the pen drawn on its edge
+        return rect.isNull() ? QRect() : rect.adjusted(-2, -2, 2, 2);
+    }
+
+    QRect selection;
+    vector<QRect> guides;
+};
+
+// Full-resolution decodes behind reduced previews. A decode cannot be interrupted, so a superseded one keeps
+// running on its own thread and is joined once it has finished, when the next import starts, or on close;
+// the GUI thread never waits for it.
+class Import_Decoders {
+public:
+    ~Import_Decoders() {
+        joinAll();
+    }
+    void start(function<void()> decode) {
+        reap();
+        shared_ptr<atomic<bool>> done = make_shared<atomic<bool>>(false);
+        running.push_back({ thread([decode, done]() {
+            decode();
+            *done = true;
+        }), done });
+    }
+    void joinAll() {
+        for (Decode& entry : running) {
+            entry.worker.join();
+        }
+        running.clear();
+    }
+
+private:
+    struct Decode {
+        thread worker;
+        shared_ptr<atomic<bool>> done;
+    };
+    void reap() {
+        for (auto it = running.begin(); it != running.end(); ) {
+            if (*it->done) {
+                it->worker.join();  // the thread has returned from decode, joining is immediate
+                it = running.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    vector<Decode> running;
+};
+
+class Render_Worker {       // renders previews off the GUI thread, only the newest request is ever computed
+public:
+    typedef function<QImage(const function<bool()>& cancelled)> Job;
+    typedef function<void(const QImage&)> Delivery;
+
+    ~Render_Worker() {
+        stop();
+    }
+    void submit(QObject* receiver, Job job, Delivery deliver) {    // replaces any request that has not started yet
+        submitted++;        // read without the lock by background work that yields to real input
+        lock_guard<mutex> lock(guard);
+        pending_job = job;
+        pending_delivery = deliver;
+        pending_receiver = receiver;
+        ++generation;       // whatever is in flight is stale from now on
+        if (!worker.joinable()) {
+            running = true;
+            worker = thread(&Render_Worker::run, this);
+        }
+        wake.notify_one();
+    }
+    void cancel() {     // drop the pending request and discard the one in flight
+        lock_guard<mutex> lock(guard);
+        pending_job = nullptr;
+        ++generation;
+    }
+    bool busy() const {     // a request is waiting or being rendered
+        lock_guard<mutex> lock(guard);
+        return pending_job || active;
+    }
+    unsigned long requests() const {    // requests submitted so far, changes the moment real input arrives
+        return submitted;
+    }
+    void stop() {
+        {
+            lock_guard<mutex> lock(guard);
+            running = false;
+            pending_job = nullptr;
+            ++generation;
+        }
+        wake.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+private:
+    void run() {
+        unique_lock<mutex> lock(guard);
+        while (true) {
+            wake.wait(lock, [this] { return !running || pending_job; });
+            if (!running) {
+                return;
+            }
+            Job job = pending_job;
+            Delivery deliver = pending_delivery;
+            QObject* receiver = pending_receiver;
+            unsigned long job_generation = generation;
+            pending_job = nullptr;
+            active = true;
+            lock.unlock();
+
+            function<bool()> cancelled = [this, job_generation] { return generation != job_generation; };
+            QImage frame;
+            try {
+                frame = job(cancelled);
+            }
+            catch (const std::exception& e) {
+                cout << "Preview render failed: " << e.what() << endl;
+            }
+            if (!frame.isNull() && !cancelled()) {
+                // post the frame back to the GUI thread, it is dropped there if a newer request arrived meanwhile
+                QMetaObject::invokeMethod(receiver, [this, job_generation, frame, deliver] {
+                    if (generation == job_generation) {
+                        deliver(frame);
+                    }
+                }, Qt::QueuedConnection);
+            }
+            lock.lock();
+            active = false;
+        }
+    }
+
+    thread worker;
+    mutable mutex guard;
+    condition_variable wake;
+    atomic<unsigned long> generation{ 0 };
+    atomic<unsigned long> submitted{ 0 };
+    bool running = false;
+    bool active = false;    // a job is being rendered
+    Job pending_job;
+    Delivery pending_delivery;
+    QObject* pending_receiver = nullptr;
+};
+
+// Renders the slider positions around the current one while the preview worker is idle, so most ticks of a
+// drag find their frame ready. It only starts a render when the worker has nothing to do, and the render
+// polls its cancelled callback between edits and between bands of rows, which turns true as soon as the
+// worker receives a request; the unfinished frame is dropped and the position is tried again once the worker
+// is idle. Frames are kept for one render function, identified by key, and the ones farthest from the slider
+// are dropped first.
+class Slider_Precomputer {
+public:
+    typedef function<Mat(int value, const function<bool()>& cancelled)> Render;   // an empty Mat once cancelled
+    static const int capacity = 24;     // display-sized frames, a little over 20 MB on a 600 px label
+
+    explicit Slider_Precomputer(const Render_Worker& foreground) : foreground(foreground) {}
+    ~Slider_Precomputer() {
+        stop();
+    }
+    void follow(size_t key, Render render, int value, int minimum, int maximum, Size frame) {   // the slider is at value
+        lock_guard<mutex> lock(guard);
+        if (key != session_key || frame != frame_size) {
+            session_key = key;
+            session_render = render;
+            frame_size = frame;
+            frames.clear();
+            ++generation;   // a frame in flight belongs to the previous session
+        }
+        center = value;
+        direction = value > last_value ? 1 : (value < last_value ? -1 : direction);
+        last_value = value;
+        lowest = minimum;
+        highest = maximum;
+        if (!worker.joinable()) {
+            running = true;
+            worker = thread(&Slider_Precomputer::run, this);
+        }
+        wake.notify_one();
+    }
+    bool take(size_t key, int value, QImage& frame) {     // a tick of the slider, counted for the hit rate
+        lock_guard<mutex> lock(guard);
+        auto found = key == session_key ? frames.find(value) : frames.end();
+        if (found == frames.end()) {
+            miss_count++;
+            return false;
+        }
+        hit_count++;
+        frame = found->second;
+        return true;
+    }
+    void end() {    // the slider was hidden, its frames are of no further use
+        lock_guard<mutex> lock(guard);
+        session_render = nullptr;
+        session_key = 0;
+        frames.clear();
+        ++generation;
+    }
+    void stop() {
+        {
+            lock_guard<mutex> lock(guard);
+            running = false;
+            session_render = nullptr;
+        }
+        wake.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    long long hits() const { return hit_count; }
+    long long misses() const { return miss_count; }
+    double hitRate() const {
+        long long ticks = hit_count + miss_count;
+        return ticks ? static_cast<double>(hit_count) / ticks : 0;
+    }
+    size_t cachedFrames() {
+        lock_guard<mutex> lock(guard);
+        return frames.size();
+    }
+
+private:
+    bool nextValue(int& value) const {  // nearest uncached position, ahead of the drag first
+        for (int distance = 1; distance <= capacity / 2; distance++) {
+            for (int side : { direction, -direction }) {
+                int candidate = center + side * distance;
+                if (candidate >= lowest && candidate <= highest && !frames.count(candidate)) {
+                    value = candidate;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    void run() {
+        Display_Surface surface;
+        unique_lock<mutex> lock(guard);
+        while (running) {
+            int value = 0;
+            if (!session_render || !nextValue(value)) {
+                wake.wait(lock);
+                continue;
+            }
+            if (foreground.busy()) {    // real input first, look again shortly
+                wake.wait_for(lock, std::chrono::milliseconds(5));
+                continue;
+            }
+            Render render = session_render;
+            Size frame = frame_size;
+            unsigned long job_generation = generation;
+            unsigned long foreground_requests = foreground.requests();
+            lock.unlock();
+            function<bool()> cancelled = [this, job_generation, foreground_requests] {
+                return generation != job_generation || foreground.requests() != foreground_requests;
+            };
+            QImage image;
+            bool preempted = false;
+            try {
+                IMAGECRAFT_TRACE("speculative render");
+                Mat rendered = render(value, cancelled);
+                preempted = rendered.empty() && cancelled();
+                if (!preempted) {
+                    image = surface.present(rendered, frame.width, frame.height).copy();   // the surface reuses its buffers
+                }
+            }
+            catch (const std::exception&) {
+                image = QImage();   // the tick itself reports the error
+            }
+            lock.lock();
+            if (preempted || generation != job_generation || image.isNull()) {
+                if (!preempted && generation == job_generation) {
+                    session_render = nullptr;   // the same render fails at every value
+                }
+                continue;
+            }
+            frames[value] = image;
+            while (static_cast<int>(frames.size()) > capacity) {   // the position farthest from the slider goes
+                auto farthest = abs(frames.begin()->first - center) > abs(frames.rbegin()->first - center) ? frames.begin() : std::prev(frames.end());
+                frames.erase(farthest);
+            }
+        }
+    }
+
+    const Render_Worker& foreground;
+    thread worker;
+    mutex guard;
+    condition_variable wake;
+    bool running = false;
+    size_t session_key = 0;
+    Render session_render;
+    Size frame_size;
+    std::map<int, QImage> frames;   // slider value -> display frame
+    std::atomic<unsigned long> generation{ 0 };     // changed under guard, read without it by a render in flight
+    int center = 0, last_value = 0, direction = 1, lowest = 0, highest = 0;
+    std::atomic<long long> hit_count{ 0 }, miss_count{ 0 };
+};
+
+enum class Edit_Kind { Resize, Rotate, Flip, Crop, Text, Brightness, Contrast, Blur, Filter, Color_Isolation, Transform, Channel_Mixer };
+
+const char* const filter_names[] = { "none", "gray", "sepia", "invert" };      // Filter values in recipes
+const char* const color_names[] = { "red", "green", "blue", "yellow" };        // Color_Isolation values in recipes
+
+struct Edit_Op {        // parameters of one non-destructive edit, pixels are only produced by apply()
+    Edit_Kind kind = Edit_Kind::Brightness;
+    int value = 0;          // slider value, rotate/flip state, filter index, isolated colour or Transform orientation
+    Rect region;            // crop rectangle, or the source region of a Transform, in the coordinates of the edit's input
+    string text;            // text overlay and its placement
+    string position;
+    int font_size = 0;
+    Scalar color;
+    vector<float> matrix;   // Channel_Mixer coefficients, three rows of B, G, R weights
+
+    size_t hash() const {   // identifies the parameters, equal hashes mean equal output for equal input
+        size_t h = std::hash<int>()(static_cast<int>(kind));
+        for (int field : { value, region.x, region.y, region.width, region.height, font_size }) {
+            h = combine(h, std::hash<int>()(field));
+        }
+        for (int c = 0; c < 3; c++) {
+            h = combine(h, std::hash<double>()(color[c]));
+        }
+        for (float m : matrix) {
+            h = combine(h, std::hash<float>()(m));
+        }
+        h = combine(h, std::hash<string>()(text));
+        return combine(h, std::hash<string>()(position));
+    }
+    static size_t combine(size_t seed, size_t value) {
+        return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    }
+    Mat apply(const Mat& input, double scale = 1.0) const {    // scale < 1 when rendering on a preview proxy
+        Image_Filters filters;
+        Image_Operations imageOps;
+        Mat img = input;
+        switch (kind) {
+        case Edit_Kind::Resize:
+            return imageOps.resizeImage(img, value);
+        case Edit_Kind::Rotate:
+            return imageOps.rotateimage(img, value);
+        case Edit_Kind::Flip:
+            return imageOps.flipimage(img, value);
+        case Edit_Kind::Crop:
+            return img(scaledRegion(img, scale));     // a view, the input stays cached and unchanged
+        case Edit_Kind::Transform:
+            return orient(img(scaledRegion(img, scale)), value);    // only the surviving region is read
+        case Edit_Kind::Text:
+            return drawText(img, scale, img.size(), Point(0, 0));
+        case Edit_Kind::Brightness:
+            return filters.brightness_adjustment(img, value);
+        case Edit_Kind::Contrast:
+            return filters.contrast_adjustment(img, value);
+        case Edit_Kind::Blur:
+            return value == 0 ? img : filters.blur_adjustment(img, value, scale);
+        case Edit_Kind::Filter: {
+            if (value == 1) { // Grayscale
+                return filters.gray_bgr_filter(img);
+            }
+            else if (value == 2) { // Sepia
+                return filters.sepia_filter(img);
+            }
+            else if (value == 3) { // Inversion
+                return filters.color_inversion(img);
+            }
+            return img;
+        }
+        case Edit_Kind::Color_Isolation:
+            return filters.color_isolation(img, value);
+        case Edit_Kind::Channel_Mixer: {
+            float m[3][3];
+            for (int i = 0; i < 9; i++) {
+                m[i / 3][i % 3] = matrix.at(i);
+            }
+            return filters.channel_mixer(img, Color_Matrix::fromFloat(m));
+        }
+        }
+        return img;
+    }
+    Size outputSize(Size input) const {    // size apply() produces for an input of this size
+        switch (kind) {
+        case Edit_Kind::Resize:
+            return Size(cvRound(input.width * value / 100.0), cvRound(input.height * value / 100.0));
+        case Edit_Kind::Rotate:
+            return value == 0 ? input : Size(input.height, input.width);
+        case Edit_Kind::Crop:
+            return (region & Rect(0, 0, input.width, input.height)).size();
+        case Edit_Kind::Transform:
+            return outputSize();
+        default:
+            return input;
+        }
+    }
+    int reach(double scale = 1.0) const {     // pixels each output pixel reads on every side of its own position, apply() at scale
+        if (kind == Edit_Kind::Blur && value > 0) {
+            double sigma = Blur_Engine::sliderSigma(value);     // the same branches as blur_adjustment
+            return scale < 1.0 ? Blur_Engine::radius(sigma * scale) : Blur_Engine::radius(sigma, value * 2 + 1);
+        }
+        return kind == Edit_Kind::Blur && value < 0 ? 1 : 0;    // the 3x3 sharpen kernel
+    }
+    Rect textBounds(Size canvas) const {   // where a Text edit draws on a full resolution image of this size
+        int baseline = 0;
+        Point origin = textOrigin(1.0, canvas, baseline);
+        Size size = getTextSize(text, FONT_HERSHEY_SIMPLEX, font_size / 10.0, 4, &baseline);
+        return Rect(origin.x, origin.y - size.height, size.width, size.height + baseline);
+    }
+    bool geometric() const {
+        return kind == Edit_Kind::Resize || kind == Edit_Kind::Rotate || kind == Edit_Kind::Flip || kind == Edit_Kind::Crop || kind == Edit_Kind::Transform;
+    }
+    bool pixelwise() const {    // each output pixel depends only on the input pixel at the same place
+        return kind == Edit_Kind::Brightness || kind == Edit_Kind::Contrast || kind == Edit_Kind::Filter || kind == Edit_Kind::Color_Isolation
+            || kind == Edit_Kind::Channel_Mixer || (kind == Edit_Kind::Blur && value == 0);
+    }
+    bool pointOp() const {      // a per-channel lookup table, fuses with its neighbours into one Point_Op_Chain
+        return kind == Edit_Kind::Brightness || kind == Edit_Kind::Contrast || (kind == Edit_Kind::Filter && value == 3);
+    }
+
+    // Rotations, flips and crops in a row are kept as one Transform: a source region and one of the
+    // eight orientations of the square (value bit 0 transposes, bit 1 mirrors x, bit 2 mirrors y).
+    // Pixels are only moved when the Transform is applied, in a single pass over the region.
+    static Edit_Op transform(Size input) {     // leaves an image of this size unchanged
+        Edit_Op op;
+        op.kind = Edit_Kind::Transform;
+        op.region = Rect(0, 0, input.width, input.height);
+        return op;
+    }
+    Size outputSize() const {
+        return (value & 1) ? Size(region.height, region.width) : region.size();
+    }
+    Edit_Op then(const Edit_Op& op) const {     // this Transform followed by a Rotate, Flip or Crop
+        bool t = value & 1;
+        int sign_x = (value & 2) ? -1 : 1, sign_y = (value & 4) ? -1 : 1;
+        // source = m * output + m0, and the new edit maps its output into ours as n * output + n0
+        int m[2][2] = { { t ? 0 : sign_x, t ? sign_x : 0 }, { t ? sign_y : 0, t ? 0 : sign_y } };
+        int m0[2] = { region.x + (sign_x < 0 ? region.width - 1 : 0), region.y + (sign_y < 0 ? region.height - 1 : 0) };
+        Size current = outputSize(), size = current;
+        int n[2][2] = { { 1, 0 }, { 0, 1 } };
+        int n0[2] = { 0, 0 };
+        if (op.kind == Edit_Kind::Rotate) {
+            size = Size(current.height, current.width);
+            n[0][0] = n[1][1] = 0;
+            n[0][1] = op.value == 1 ? 1 : -1;
+            n[1][0] = -n[0][1];
+            n0[0] = op.value == 1 ? 0 : current.width - 1;
+            n0[1] = op.value == 1 ? current.height - 1 : 0;
+        }
+        else if (op.kind == Edit_Kind::Flip) {
+            n[0][0] = op.value == 1 ? -1 : 1;       // 1 mirrors left-right, -1 top-bottom
+            n[1][1] = -n[0][0];
+            n0[0] = op.value == 1 ? current.width - 1 : 0;
+            n0[1] = op.value == 1 ? 0 : current.height - 1;
+        }
+        else if (op.kind == Edit_Kind::Crop) {
+            Rect kept = op.region & Rect(0, 0, current.width, current.height);
+            if (kept.empty()) {
+                throw std::runtime_error("Crop area is outside the image.");
+            }
+            size = kept.size();
+            n0[0] = kept.x;
+            n0[1] = kept.y;
+        }
+        int k[2][2], k0[2];
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                k[i][j] = m[i][0] * n[0][j] + m[i][1] * n[1][j];
+            }
+            k0[i] = m[i][0] * n0[0] + m[i][1] * n0[1] + m0[i];
+        }
+        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+        for (Point corner : { Point(0, 0), Point(size.width - 1, 0), Point(0, size.height - 1), Point(size.width - 1, size.height - 1) }) {
+            int x = k[0][0] * corner.x + k[0][1] * corner.y + k0[0];
+            int y = k[1][0] * corner.x + k[1][1] * corner.y + k0[1];
+            min_x = min(min_x, x);
+            max_x = max(max_x, x);
+            min_y = min(min_y, y);
+            max_y = max(max_y, y);
+        }
+        Edit_Op combined = *this;
+        combined.region = Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+        bool transposed = k[0][0] == 0;
+        combined.value = (transposed ? 1 : 0) | ((transposed ? k[0][1] : k[0][0]) < 0 ? 2 : 0) | ((transposed ? k[1][0] : k[1][1]) < 0 ? 4 : 0);
+        return combined;
+    }
+    static Mat orient(const Mat& roi, int orientation) {    // a view when nothing moves, otherwise one pass
+        if (orientation == 0) {
+            return roi;
+        }
+        Mat out;
+        if (!(orientation & 1)) {
+            flip(roi, out, (orientation & 6) == 6 ? -1 : ((orientation & 2) ? 1 : 0));
+            return out;
+        }
+        out.create(roi.cols, roi.rows, roi.type());
+        switch (roi.elemSize()) {
+        case 1: transposeBlocked<1>(roi, out, orientation); break;
+        case 3: transposeBlocked<3>(roi, out, orientation); break;
+        case 4: transposeBlocked<4>(roi, out, orientation); break;
+        default: {
+            Mat transposed;
+            transpose(roi, transposed);
+            return orient(transposed, ((orientation & 2) ? 4 : 0) | ((orientation & 4) ? 2 : 0));    // mirrors swap axes after transposing
+        }
+        }
+        return out;
+    }
+
+    string format() const {     // the "name=value" form parse() reads back
+        switch (kind) {
+        case Edit_Kind::Resize:
+            return "resize=" + to_string(value);
+        case Edit_Kind::Rotate:
+            return "rotate=" + to_string(value);
+        case Edit_Kind::Flip:
+            return "flip=" + to_string(value);
+        case Edit_Kind::Crop:
+            return format("crop=%d,%d,%d,%d", region.x, region.y, region.width, region.height);
+        case Edit_Kind::Transform:
+            return format("transform=%d,%d,%d,%d,%d", region.x, region.y, region.width, region.height, value);
+        case Edit_Kind::Text:
+            return "text=" + position + format(":%d:%02x%02x%02x:", font_size, cvRound(color[2]), cvRound(color[1]), cvRound(color[0])) + text;
+        case Edit_Kind::Brightness:
+            return "brightness=" + to_string(value);
+        case Edit_Kind::Contrast:
+            return "contrast=" + to_string(value);
+        case Edit_Kind::Blur:
+            return "blur=" + to_string(value);
+        case Edit_Kind::Filter:
+            return string("filter=") + filter_names[value >= 0 && value < 4 ? value : 0];
+        case Edit_Kind::Color_Isolation:
+            return string("color=") + color_names[value >= 0 && value < 4 ? value : 0];
+        case Edit_Kind::Channel_Mixer: {
+            string spec = "mixer=";
+            for (size_t i = 0; i < matrix.size(); i++) {
+                spec += format(i ? ",%g" : "%g", matrix[i]);
+            }
+            return spec;
+        }
+        }
+        return "";
+    }
+
+    Mat applyTile(const Mat& tile, const Rect& tile_rect, Size image_size) const {   // tile of a larger image, text is placed on the whole image
+        if (kind == Edit_Kind::Text) {
+            return drawText(tile, 1.0, image_size, tile_rect.tl());
+        }
+        return apply(tile);
+    }
+    // apply() one band of rows at a time, each read with its halo so the result is the same, checking cancelled
+    // before every band. Empty once cancelled. Geometric and text edits need the whole image and run in one go.
+    Mat applyInBands(const Mat& input, double scale, const function<bool()>& cancelled) const {
+        if (geometric() || kind == Edit_Kind::Text) {
+            return cancelled() ? Mat() : apply(input, scale);
+        }
+        int halo = reach(scale);
+        int band = max(64, 4 * halo);   // the halo adds at most half a band of work
+        Rect bounds(0, 0, input.cols, input.rows);
+        Mat output;
+        for (int y = 0; y < input.rows; y += band) {
+            if (cancelled()) {
+                return Mat();
+            }
+            Rect core(0, y, input.cols, min(band, input.rows - y));
+            Rect padded = Rect(0, y - halo, input.cols, core.height + 2 * halo) & bounds;
+            Mat pixels = apply(input(padded), scale);
+            if (output.empty()) {
+                output.create(input.size(), pixels.type());
+            }
+            pixels(Rect(0, core.y - padded.y, core.width, core.height)).copyTo(output(core));
+        }
+        return output;
+    }
+    static Edit_Op parse(const string& spec) {     // "name=value", e.g. brightness=20, filter=sepia, crop=x,y,w,h, mixer=9 weights
+        size_t equals = spec.find('=');
+        string name = spec.substr(0, equals);
+        string value = equals == string::npos ? "" : spec.substr(equals + 1);
+        Edit_Op op;
+        if (name == "resize") {
+            op.kind = Edit_Kind::Resize;
+            op.value = number(name, value);
+        }
+        else if (name == "rotate") {
+            op.kind = Edit_Kind::Rotate;    // 1 clockwise, -1 anticlockwise
+            op.value = number(name, value);
+            if (op.value != 1 && op.value != -1) {
+                throw std::invalid_argument("rotate needs 1 (clockwise) or -1 (anticlockwise)");
+            }
+        }
+        else if (name == "flip") {
+            op.kind = Edit_Kind::Flip;      // 1 mirrors left-right (cv::flip code 1), -1 top-bottom (code 0)
+            op.value = number(name, value);
+            if (op.value != 1 && op.value != -1) {
+                throw std::invalid_argument("flip needs 1 (left-right) or -1 (top-bottom)");
+            }
+        }
+        else if (name == "crop") {
+            op.kind = Edit_Kind::Crop;
+            int consumed = 0;
+            if (sscanf(value.c_str(), "%d,%d,%d,%d%n", &op.region.x, &op.region.y, &op.region.width, &op.region.height, &consumed) != 4
+                || consumed != static_cast<int>(value.size())) {
+                throw std::invalid_argument("crop needs x,y,width,height");
+            }
+        }
+        else if (name == "transform") {
+            op.kind = Edit_Kind::Transform;     // x,y,w,h,orientation
+            int consumed = 0;
+            if (sscanf(value.c_str(), "%d,%d,%d,%d,%d%n", &op.region.x, &op.region.y, &op.region.width, &op.region.height, &op.value, &consumed) != 5
+                || consumed != static_cast<int>(value.size()) || op.value < 0 || op.value > 7) {
+                throw std::invalid_argument("transform needs x,y,width,height,orientation");
+            }
+        }
+        else if (name == "mixer") {
+            op.kind = Edit_Kind::Channel_Mixer;     // output rows B, G, R of input weights B, G, R
+            for (char* p = &value[0]; *p; ) {
+                char* end = p;
+                op.matrix.push_back(strtof(p, &end));
+                if (end == p || (*end != ',' && *end != '\0')) {
+                    throw std::invalid_argument("mixer needs nine comma separated weights");
+                }
+                p = *end ? end + 1 : end;
+            }
+            if (op.matrix.size() != 9) {
+                throw std::invalid_argument("mixer needs nine comma separated weights");
+            }
+        }
+        else if (name == "text") {
+            op.kind = Edit_Kind::Text;      // POSITION:SIZE:RRGGBB:TEXT
+            char position[32] = {};
+            unsigned int rgb = 0xffffff;
+            int consumed = 0;
+            if (sscanf(value.c_str(), "%31[^:]:%d:%x:%n", position, &op.font_size, &rgb, &consumed) < 3 || consumed == 0) {
+                throw std::invalid_argument("text needs POSITION:SIZE:RRGGBB:TEXT");
+            }
+            op.position = position;
+            op.text = value.substr(consumed);
+            op.color = Scalar(rgb & 0xff, (rgb >> 8) & 0xff, (rgb >> 16) & 0xff);
+        }
+        else if (name == "brightness") {
+            op.kind = Edit_Kind::Brightness;
+            op.value = number(name, value);
+        }
+        else if (name == "contrast") {
+            op.kind = Edit_Kind::Contrast;
+            op.value = number(name, value);
+        }
+        else if (name == "blur") {
+            op.kind = Edit_Kind::Blur;
+            op.value = number(name, value);
+        }
+        else if (name == "filter") {
+            op.kind = Edit_Kind::Filter;
+            op.value = named(name, value, filter_names);
+        }
+        else if (name == "color") {
+            op.kind = Edit_Kind::Color_Isolation;
+            op.value = named(name, value, color_names);
+        }
+        else {
+            throw std::invalid_argument("Unknown edit: " + spec);
+        }
+        return op;
+    }
+
+private:
+    static int number(const string& name, const string& value) {     // the whole value must be a decimal integer
+        errno = 0;
+        char* end = nullptr;
+        long parsed = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX) {
+            throw std::invalid_argument(name + " needs a whole number, got \"" + value + "\"");
+        }
+        return static_cast<int>(parsed);
+    }
+    static int named(const string& name, const string& value, const char* const (&names)[4]) {    // index of value in names
+        for (int i = 0; i < 4; i++) {
+            if (value == names[i]) {
+                return i;
+            }
+        }
+        throw std::invalid_argument("Unknown " + name + " \"" + value + "\", expected " + names[0] + ", " + names[1] + ", " + names[2] + " or " + names[3]);
+    }
+    static string format(const char* pattern, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, pattern);
+        vsnprintf(buffer, sizeof(buffer), pattern, args);
+        va_end(args);
+        return buffer;
+    }
+    Rect scaledRegion(const Mat& img, double scale) const {    // region on a proxy rendered at scale
+        Rect scaled(cvRound(region.x * scale), cvRound(region.y * scale), cvRound(region.width * scale), cvRound(region.height * scale));
+        scaled &= Rect(0, 0, img.cols, img.rows);
+        if (scaled.empty()) {
+            throw std::runtime_error("Crop area is outside the image.");
+        }
+        return scaled;
+    }
+    template <int pixel_bytes>
+    static void transposeBlocked(const Mat& roi, Mat& out, int orientation) {     // 64x64 blocks keep the column walk over roi in cache
+        const int block = 64;
+        bool mirror_x = orientation & 2, mirror_y = orientation & 4;
+        parallel_for_(Range(0, (out.rows + block - 1) / block), [&](const Range& blocks) {
+            for (int by = blocks.start * block; by < min(blocks.end * block, out.rows); by += block) {
+                for (int bx = 0; bx < out.cols; bx += block) {
+                    for (int y = by; y < min(by + block, out.rows); y++) {
+                        int sx = mirror_x ? roi.cols - 1 - y : y;
+                        uchar* dst = out.ptr(y);
+                        for (int x = bx; x < min(bx + block, out.cols); x++) {
+                            int sy = mirror_y ? roi.rows - 1 - x : x;
+                            memcpy(dst + x * pixel_bytes, roi.ptr(sy) + sx * pixel_bytes, pixel_bytes);
+                        }
+                    }
+                }
+            }
+        });
+    }
+    Mat drawText(const Mat& img, double scale, Size canvas, Point offset) const {  // canvas is the whole image, img sits at offset in it
+        int baseline = 0;
+        cv::Point textOrg = textOrigin(scale, canvas, baseline);
+        Mat result = img.clone();   // inputs are cached by the edit graph and must not be drawn on
+        putText(result, text, textOrg - offset, FONT_HERSHEY_SIMPLEX, font_size / 10.0 * scale, color, max(1, cvRound(4 * scale)));    // glyphs outside img are clipped
+        return result;
+    }
+    Point textOrigin(double scale, Size canvas, int& baseline) const {    // bottom left of the text for the chosen position
+        int fontFace = FONT_HERSHEY_SIMPLEX;
+        double fontScale = font_size / 10.0 * scale;
+        int thickness = max(1, cvRound(4 * scale));
+        int margin = max(1, cvRound(10 * scale));
+        cv::Size textSize = cv::getTextSize(text, fontFace, fontScale, thickness, &baseline);
+
+        cv::Point textOrg;
+        if (position == "Top-Left") {
+            textOrg = cv::Point(margin, textSize.height + margin);
+        }
+        else if (position == "Top-Right") {
+            textOrg = cv::Point(canvas.width - textSize.width - margin, textSize.height + margin);
+        }
+        else if (position == "Bottom-Left") {
+            textOrg = cv::Point(margin, canvas.height - margin);
+        }
+        else if (position == "Bottom-Right") {
+            textOrg = cv::Point(canvas.width - textSize.width - margin, canvas.height - margin);
+        }
+        else if (position == "Center") {
+            textOrg = cv::Point((canvas.width - textSize.width) / 2, (canvas.height + textSize.height) / 2);
+        }
+        return textOrg;
+    }
+};
+
+class Scratch_File {    // raw pixels of spilled images in a temporary file, removed when the program exits
+public:
+    class Extent {      // one spilled image, its bytes are reused once the last holder lets go of it
+    public:
+        Extent(Scratch_File* file, streamoff offset, Size size, int type) : file(file), offset(offset), size(size), type(type) {}
+        ~Extent() { file->release(offset, bytes()); }
+        Extent(const Extent&) = delete;
+        Extent& operator=(const Extent&) = delete;
+        Mat read() const { return file->read(*this); }
+        size_t bytes() const { return static_cast<size_t>(size.area()) * CV_ELEM_SIZE(type); }
+
+    private:
+        friend class Scratch_File;
+        Scratch_File* file;
+        streamoff offset;
+        Size size;
+        int type;
+    };
+
+    ~Scratch_File() {
+        if (stream.is_open()) {
+            stream.close();
+            std::error_code ignored;
+            std::filesystem::remove(path, ignored);
+        }
+    }
+    shared_ptr<Extent> write(const Mat& img) {
+        open();
+        size_t bytes = img.total() * img.elemSize();
+        streamoff offset = end;
+        auto reusable = free_extents.find(bytes);   // frames of one image are all the same size
+        if (reusable != free_extents.end()) {
+            offset = reusable->second;
+            free_extents.erase(reusable);
+        }
+        else {
+            end += static_cast<streamoff>(bytes);
+        }
+        stream.seekp(offset);
+        size_t row_bytes = img.cols * img.elemSize();
+        for (int y = 0; y < img.rows; y++) {
+            stream.write(reinterpret_cast<const char*>(img.ptr(y)), row_bytes);
+        }
+        stream.flush();
+        if (!stream) {
+            throw std::runtime_error("Cannot write the scratch file " + path.string());
+        }
+        used += bytes;
+        return make_shared<Extent>(this, offset, img.size(), img.type());
+    }
+    size_t bytes() const {      // spilled pixels still referenced
+        return used;
+    }
+
+private:
+    void open() {
+        if (stream.is_open()) {
+            return;
+        }
+        const char* directory = getenv("IMAGECRAFT_SCRATCH_DIR");
+        path = std::filesystem::path(directory ? directory : std::filesystem::temp_directory_path().string())
+            / ("imagecraft-" + to_string(getTickCount()) + ".scratch");
+        stream.open(path, ios::in | ios::out | ios::binary | ios::trunc);
+        if (!stream) {
+            throw std::runtime_error("Cannot create the scratch file " + path.string());
+        }
+    }
+    Mat read(const Extent& extent) {
+        Mat img(extent.size, extent.type);
+        stream.seekg(extent.offset);
+        size_t row_bytes = img.cols * img.elemSize();
+        for (int y = 0; y < img.rows; y++) {
+            stream.read(reinterpret_cast<char*>(img.ptr(y)), row_bytes);
+        }
+        if (!stream) {
+            throw std::runtime_error("Cannot read the scratch file " + path.string());
+        }
+        return img;
+    }
+    void release(streamoff offset, size_t bytes) {
+        free_extents.emplace(bytes, offset);
+        used -= bytes;
+    }
+
+    std::filesystem::path path;
+    fstream stream;
+    streamoff end = 0;
+    multimap<size_t, streamoff> free_extents;   // byte count -> offset of space a released extent left behind
+    size_t used = 0;
+};
+
+class Edit_Graph {      // chain of edits on top of the original image, every node caches its output
+public:
+    struct Node {
+        Edit_Op op;
+        size_t output_hash = 0;     // hash of the source and every parameter up to this node when output was rendered
+        Mat output;
+        shared_ptr<Scratch_File::Extent> spilled;   // copy of output on disk, output may then be released
+    };
+
+    void setSource(const Mat& img) {    // a new image invalidates every node
+        source = img;
+        source_hash = Edit_Op::combine(reinterpret_cast<size_t>(img.data), ++source_generation);
+        nodes.clear();
+    }
+    void clear() {
+        nodes.clear();
+    }
+    int append(const Edit_Op& op) {
+        detached.clear();   // a new edit drops the redo branch
+        Node node;
+        node.op = op;
+        nodes.push_back(node);
+        return static_cast<int>(nodes.size()) - 1;
+    }
+    void update(int index, const Edit_Op& op) {     // nodes after index are re-rendered on the next render()
+        nodes.at(index).op = op;
+    }
+    void remove(int index) {
+        nodes.erase(nodes.begin() + index);
+    }
+    int find(Edit_Kind kind) const {    // last node of this kind, -1 if there is none
+        for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+            if (nodes[i].op.kind == kind) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    const Edit_Op& op(int index) const {
+        return nodes.at(index).op;
+    }
+    int size() const {
+        return static_cast<int>(nodes.size());
+    }
+    vector<Edit_Op> ops(int first) const {     // parameters of every node from first on
+        vector<Edit_Op> tail;
+        for (int i = first; i < size(); i++) {
+            tail.push_back(nodes[i].op);
+        }
+        return tail;
+    }
+    void restore(const vector<Edit_Op>& restored) {     // switch to another edit list, reusing every cache that still matches
+        vector<Node> result;
+        for (size_t i = 0; i < restored.size(); i++) {
+            size_t hash = restored[i].hash();
+            if (i < nodes.size() && nodes[i].op.hash() == hash) {
+                result.push_back(nodes[i]);
+            }
+            else if (i < detached.size() && detached[i].op.hash() == hash) {
+                result.push_back(detached[i]);  // redo after undo finds the undone renders here
+            }
+            else {
+                Node node;
+                node.op = restored[i];
+                result.push_back(node);
+            }
+        }
+        detached = nodes;
+        nodes = result;
+    }
+    bool cached() const {   // true when render() needs no edit to run
+        return nodes.empty() || (nodes.back().output_hash == chainHash() && (!nodes.back().output.empty() || nodes.back().spilled));
+    }
+    void seed(const Mat& output) {  // adopt a known render of the whole chain, e.g. reassembled from the undo history
+        if (!nodes.empty()) {
+            nodes.back().output = output;
+            nodes.back().output_hash = chainHash();
+            nodes.back().spilled.reset();
+        }
+    }
+    void images(vector<const Mat*>& held) const {   // every buffer the graph keeps alive
+        held.push_back(&source);
+        for (const vector<Node>* list : { &nodes, &detached }) {
+            for (const Node& node : *list) {
+                held.push_back(&node.output);
+            }
+        }
+    }
+    // Spills the coldest cache whose buffer only the graph holds: the redo branch first, then the oldest node.
+    // The last node is what is displayed and is never spilled. False when nothing can be freed.
+    bool spillColdest(Scratch_File& scratch) {
+        vector<Node*> candidates;
+        for (Node& node : detached) {
+            candidates.push_back(&node);
+        }
+        for (int i = 0; i + 1 < size(); i++) {
+            candidates.push_back(&nodes[i]);
+        }
+        for (Node* candidate : candidates) {
+            const UMatData* buffer = candidate->output.u;
+            if (!buffer || buffer == source.u || buffer == nodes.back().output.u) {
+                continue;
+            }
+            vector<Node*> holders;
+            for (vector<Node>* list : { &nodes, &detached }) {
+                for (Node& node : *list) {
+                    if (node.output.u == buffer) {
+                        holders.push_back(&node);
+                    }
+                }
+            }
+            if (static_cast<int>(holders.size()) != buffer->refcount) {
+                continue;   // the display, the undo history or a preview still shares it, spilling frees nothing
+            }
+            for (size_t i = 0; i < holders.size(); i++) {
+                for (size_t j = 0; j < i && !holders[i]->spilled; j++) {
+                    if (holders[j]->output.data == holders[i]->output.data && holders[j]->output.size() == holders[i]->output.size()) {
+                        holders[i]->spilled = holders[j]->spilled;  // the redo branch keeps copies of the same node
+                    }
+                }
+                if (!holders[i]->spilled) {
+                    holders[i]->spilled = scratch.write(holders[i]->output);
+                }
+            }
+            for (Node* holder : holders) {
+                holder->output.release();
+            }
+            return true;
+        }
+        return false;
+    }
+    Mat render() {
+        return renderBefore(size());
+    }
+    Mat renderBefore(int index) {   // input of node index, unchanged prefixes are served from cache
+        IMAGECRAFT_TRACE("Edit_Graph::render");
+        if (source.empty()) {
+            throw std::runtime_error("Image is empty, nothing to render.");
+        }
+        Mat img = source;
+        size_t hash = source_hash;
+        for (int i = 0; i < index && i < size(); i++) {
+            Node& node = nodes[i];
+            hash = Edit_Op::combine(hash, node.op.hash());
+            if (node.output_hash != hash || (node.output.empty() && !node.spilled)) {
+                node.output = node.op.apply(img);
+                node.output_hash = hash;
+                node.spilled.reset();
+            }
+            else if (node.output.empty()) {
+                node.output = node.spilled->read();     // faulted back in, the disk copy stays valid for the next spill
+            }
+            img = node.output;
+        }
+        return img;
+    }
+
+private:
+    size_t chainHash() const {
+        size_t hash = source_hash;
+        for (const Node& node : nodes) {
+            hash = Edit_Op::combine(hash, node.op.hash());
+        }
+        return hash;
+    }
+
+    Mat source;
+    size_t source_hash = 0;
+    unsigned long source_generation = 0;
+    vector<Node> nodes;
+    vector<Node> detached;      // nodes replaced by the last restore()
+};
+
+class Undo_History {        // edit states stored as copy-on-write tiles, bounded by a byte budget
+public:
+    explicit Undo_History(size_t budget_bytes = 512ull * 1024 * 1024) : budget(budget_bytes) {}
+
+    void clear() {
+        states.clear();
+        cursor = -1;
+    }
+    void setBudget(size_t budget_bytes) {
+        budget = budget_bytes;
+        evict();
+    }
+    size_t budgetBytes() const {
+        return budget;
+    }
+    // Drops the oldest undo state, or the newest redo state when there is none, so their tiles stop pinning
+    // render caches. False when only the current state is left.
+    bool dropFarthest() {
+        if (cursor > 0) {
+            states.erase(states.begin());
+            cursor--;
+            return true;
+        }
+        if (canRedo()) {
+            states.pop_back();
+            return true;
+        }
+        return false;
+    }
+    // records the edits and their rendered image, tiles equal to the current state's are shared instead of copied
+    void record(const vector<Edit_Op>& ops, const Mat& image) {
+        if (cursor >= 0 && sameOps(states[cursor].ops, ops) && states[cursor].size == image.size()) {
+            return;     // committing an unchanged slider is not an edit
+        }
+        State state;
+        state.ops = ops;
+        state.size = image.size();
+        state.type = image.type();
+        const State* previous = cursor >= 0 ? &states[cursor] : nullptr;
+        if (previous && previous->size == state.size && previous->type == state.type) {
+            vector<bool> changed;
+            size_t changed_count = 0;
+            for (const Tile& tile : previous->tiles) {
+                changed.push_back(!samePixels(image(tile.rect), tile.pixels));
+                changed_count += changed.back();
+            }
+            // a local edit copies only the tiles it touched, a full-frame edit keeps views into its own render
+            bool local = changed_count * 2 < previous->tiles.size();
+            for (size_t i = 0; i < previous->tiles.size(); i++) {
+                const Rect& rect = previous->tiles[i].rect;
+                Mat pixels = !changed[i] ? previous->tiles[i].pixels : (local ? image(rect).clone() : image(rect));
+                state.tiles.push_back({ rect, pixels });
+            }
+        }
+        else {
+            for (int y = 0; y < image.rows; y += tile_size) {
+                for (int x = 0; x < image.cols; x += tile_size) {
+                    Rect rect(x, y, min(tile_size, image.cols - x), min(tile_size, image.rows - y));
+                    state.tiles.push_back({ rect, image(rect) });   // renders are never written to, views are safe
+                }
+            }
+        }
+        push(state);
+    }
+    void recordCrop(const vector<Edit_Op>& ops, const Rect& region) {  // the cropped state views the surviving tiles, nothing is copied
+        if (cursor < 0) {
+            return;
+        }
+        const State& previous = states[cursor];
+        State state;
+        state.ops = ops;
+        state.size = region.size();
+        state.type = previous.type;
+        for (const Tile& tile : previous.tiles) {
+            Rect kept = tile.rect & region;
+            if (!kept.empty()) {
+                Mat pixels = tile.pixels(Rect(kept.x - tile.rect.x, kept.y - tile.rect.y, kept.width, kept.height));
+                state.tiles.push_back({ Rect(kept.x - region.x, kept.y - region.y, kept.width, kept.height), pixels });
+            }
+        }
+        push(state);
+    }
+    bool canUndo() const {
+        return cursor > 0;
+    }
+    bool canRedo() const {
+        return cursor >= 0 && cursor + 1 < static_cast<int>(states.size());
+    }
+    const vector<Edit_Op>& undo() {     // moving the cursor does not touch pixels
+        return states[--cursor].ops;
+    }
+    const vector<Edit_Op>& redo() {
+        return states[++cursor].ops;
+    }
+    Mat image() const {     // reassembles the current state, needed only when no cached render is left
+        const State& state = states[cursor];
+        Mat assembled(state.size, state.type);
+        for (const Tile& tile : state.tiles) {
+            tile.pixels.copyTo(assembled(tile.rect));
+        }
+        return assembled;
+    }
+    size_t bytes() const {      // distinct tile buffers held by the history
+        return countBytes(0);
+    }
+    void images(vector<const Mat*>& held) const {
+        for (const State& state : states) {
+            for (const Tile& tile : state.tiles) {
+                held.push_back(&tile.pixels);
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        Rect rect;
+        Mat pixels;     // shared between states until an edit changes it
+    };
+    struct State {
+        vector<Edit_Op> ops;
+        Size size;
+        int type = 0;
+        vector<Tile> tiles;
+    };
+
+    static bool sameOps(const vector<Edit_Op>& a, const vector<Edit_Op>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].hash() != b[i].hash()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static bool samePixels(const Mat& a, const Mat& b) {
+        size_t row_bytes = a.cols * a.elemSize();
+        for (int y = 0; y < a.rows; y++) {
+            if (memcmp(a.ptr(y), b.ptr(y), row_bytes) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    void push(const State& state) {
+        states.erase(states.begin() + (cursor + 1), states.end());     // a new edit drops the redo branch
+        states.push_back(state);
+        cursor = static_cast<int>(states.size()) - 1;
+        evict();
+    }
+    size_t countBytes(size_t first) const {
+        set<const UMatData*> buffers;
+        size_t total = 0;
+        for (size_t i = first; i < states.size(); i++) {
+            for (const Tile& tile : states[i].tiles) {
+                if (tile.pixels.u && buffers.insert(tile.pixels.u).second) {
+                    total += tile.pixels.u->size;
+                }
+            }
+        }
+        return total;
+    }
+    void evict() {      // oldest states go first, the current state is always kept
+        size_t first = 0;
+        while (static_cast<int>(first) < cursor && countBytes(first) > budget) {
+            first++;
+        }
+        states.erase(states.begin(), states.begin() + first);
+        cursor -= static_cast<int>(first);
+    }
+
+    static constexpr int tile_size = 256;
+    vector<State> states;
+    int cursor = -1;
+    size_t budget;
+};
+
+// One ceiling over every image the editor keeps: the source, node caches, the undo history, the display, the
+// preview proxy and the free frames cached by Frame_Pool. Past it, the pool is trimmed first, then node caches
+// that nothing else shares go to the scratch file, coldest first, and are read back when a render needs them
+// again. Undo tiles view those caches, so when nothing more can spill the farthest undo state is dropped and
+// spilling is retried. Only the source, the current render and the current state are never given up.
+class Memory_Budget {
+public:
+    Memory_Budget() {
+        if (const char* mb = getenv("IMAGECRAFT_MEMORY_MB")) {
+            ceiling_bytes = strtoull(mb, nullptr, 10) * 1024 * 1024;
+        }
+    }
+    bool enforce(Edit_Graph& graph, Undo_History& history, const vector<const Mat*>& others) {   // false when the ceiling cannot be met
+        Frame_Pool& pool = Frame_Pool::instance();
+        int spills = 0, dropped = 0;
+        while ((resident_bytes = residentBytes(graph, history, others)) > ceiling_bytes) {
+            size_t excess = resident_bytes - ceiling_bytes;
+            size_t pooled = pool.cachedBytes();     // workers keep giving frames back, read it once
+            if (pooled > 0) {
+                pool.trim(pooled > excess ? pooled - excess : 0);   // free frames cost nothing to give back
+            }
+            else if (graph.spillColdest(scratch)) {
+                spills++;
+            }
+            else if (history.dropFarthest()) {
+                dropped++;
+            }
+            else {
+                break;
+            }
+        }
+        if (spills > 0 || dropped > 0) {
+            cout << "Memory budget: spilled " << spills << " cached render(s), dropped " << dropped << " undo state(s), "
+                << resident_bytes / (1024 * 1024) << " MB resident, " << scratch.bytes() / (1024 * 1024) << " MB in the scratch file" << endl;
+        }
+        met = resident_bytes <= ceiling_bytes;
+        if (!met) {
+            cout << "Memory budget: " << resident_bytes / (1024 * 1024) << " MB resident is over the ceiling of " << ceiling_bytes / (1024 * 1024)
+                << " MB, nothing left to spill" << endl;
+        }
+        return met;
+    }
+    size_t resident() const { return resident_bytes; }     // at the last enforce()
+    size_t spilled() const { return scratch.bytes(); }
+    size_t ceiling() const { return ceiling_bytes; }
+    bool withinCeiling() const { return met; }     // at the last enforce()
+
+private:
+    static size_t residentBytes(const Edit_Graph& graph, const Undo_History& history, const vector<const Mat*>& others) {
+        vector<const Mat*> held = others;
+        graph.images(held);
+        history.images(held);
+        set<const UMatData*> buffers;
+        size_t total = 0;
+        for (const Mat* img : held) {
+            if (img->u && buffers.insert(img->u).second) {
+                total += img->u->size;
+            }
+        }
+        return total + Frame_Pool::instance().cachedBytes();
+    }
+
+    Scratch_File scratch;
+    size_t ceiling_bytes = size_t(2048) * 1024 * 1024;     // IMAGECRAFT_MEMORY_MB
+    size_t resident_bytes = 0;
+    bool met = true;
+};
+
+class Tile_Source {     // random access to rectangles of a decoded image
+public:
+    virtual ~Tile_Source() {}
+    virtual Size size() const = 0;
+    virtual int type() const = 0;
+    virtual Mat read(const Rect& rect) = 0;
+    static unique_ptr<Tile_Source> open(const string& path);    // streams uncompressed BMP, PPM and PGM, decodes anything else whole
+};
+
+class Tile_Sink {       // receives the output a tile at a time
+public:
+    virtual ~Tile_Sink() {}
+    virtual void write(const Rect& rect, const Mat& tile) = 0;
+    virtual void finish() {}
+    static unique_ptr<Tile_Sink> create(const string& path, Size size, int type);  // streams BMP, PPM and PGM, encodes anything else whole
+};
+
+class Mat_Tile_Source : public Tile_Source {
+public:
+    explicit Mat_Tile_Source(const Mat& img) : img(img) {}
+    Size size() const override { return img.size(); }
+    int type() const override { return img.type(); }
+    Mat read(const Rect& rect) override { return img(rect); }
+
+private:
+    Mat img;
+};
+
+class Mat_Tile_Sink : public Tile_Sink {
+public:
+    Mat_Tile_Sink(const string& path, Size size, int type) : path(path), img(size, type) {}
+    void write(const Rect& rect, const Mat& tile) override { tile.copyTo(img(rect)); }
+    void finish() override {
+        IMAGECRAFT_TRACE("encode");
+        if (!imwrite(path, img)) {
+            throw std::runtime_error("Could not write " + path);
+        }
+    }
+
+private:
+    string path;
+    Mat img;
+};
+
+struct Raw_Layout {     // where the rows of an uncompressed image live in its file
+    Size size;
+    int channels = 3;
+    streamoff offset = 0;
+    size_t stride = 0;
+    bool bottom_up = false;     // BMP stores the last row first
+    bool rgb = false;           // netpbm stores RGB, OpenCV wants BGR
+
+    streamoff rowOffset(int y, int x) const {
+        int row = bottom_up ? size.height - 1 - y : y;
+        return offset + static_cast<streamoff>(row) * stride + static_cast<streamoff>(x) * channels;
+    }
+};
+
+class Raw_Tile_Source : public Tile_Source {
+public:
+    Raw_Tile_Source(const string& path, const Raw_Layout& layout) : file(path, ios::binary), layout(layout) {}
+    Size size() const override { return layout.size; }
+    int type() const override { return CV_8UC(layout.channels); }
+    Mat read(const Rect& rect) override {
+        Mat tile(rect.size(), type());
+        for (int y = 0; y < rect.height; y++) {
+            file.seekg(layout.rowOffset(rect.y + y, rect.x));
+            file.read(reinterpret_cast<char*>(tile.ptr(y)), static_cast<streamsize>(rect.width) * layout.channels);
+        }
+        if (!file) {
+            throw std::runtime_error("Image file is truncated.");
+        }
+        if (layout.rgb && layout.channels == 3) {
+            cvtColor(tile, tile, COLOR_RGB2BGR);
+        }
+        return tile;
+    }
+
+private:
+    ifstream file;
+    Raw_Layout layout;
+};
+
+class Raw_Tile_Sink : public Tile_Sink {
+public:
+    Raw_Tile_Sink(const string& path, const string& header, const Raw_Layout& layout) : file(path, ios::binary | ios::trunc), layout(layout) {
+        if (!file) {
+            throw std::runtime_error("Could not write " + path);
+        }
+        file.write(header.data(), header.size());
+        file.seekp(layout.offset + static_cast<streamoff>(layout.stride) * layout.size.height - 1);
+        file.put(0);    // size the file up front so tiles can be written in any order
+    }
+    void write(const Rect& rect, const Mat& tile) override {
+        Mat pixels = tile;
+        if (layout.rgb && layout.channels == 3) {
+            cvtColor(tile, pixels, COLOR_BGR2RGB);
+        }
+        for (int y = 0; y < rect.height; y++) {
+            file.seekp(layout.rowOffset(rect.y + y, rect.x));
+            file.write(reinterpret_cast<const char*>(pixels.ptr(y)), static_cast<streamsize>(rect.width) * layout.channels);
+        }
+    }
+    void finish() override {
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("Could not finish writing the image.");
+        }
+    }
+
+private:
+    ofstream file;
+    Raw_Layout layout;
+};
+
+static string lowerExtension(const string& path) {
+    size_t dot = path.find_last_of('.');
+    string extension = dot == string::npos ? "" : path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    return extension;
+}
+
+static bool readBmpLayout(ifstream& file, Raw_Layout& layout) {     // uncompressed 24 and 32 bit bitmaps only
+    unsigned char header[54];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != 'B' || header[1] != 'M') {
+        return false;
+    }
+    auto u16 = [&](int at) { return header[at] | (header[at + 1] << 8); };
+    auto s32 = [&](int at) { return static_cast<int32_t>(header[at] | (header[at + 1] << 8) | (header[at + 2] << 16) | (static_cast<uint32_t>(header[at + 3]) << 24)); };
+    int bits = u16(28);
+    if (s32(30) != 0 || (bits != 24 && bits != 32)) {
+        return false;
+    }
+    int height = s32(22);
+    layout.size = Size(s32(18), abs(height));
+    layout.channels = bits / 8;
+    layout.offset = s32(10);
+    layout.stride = (static_cast<size_t>(layout.size.width) * layout.channels + 3) & ~static_cast<size_t>(3);
+    layout.bottom_up = height > 0;
+    return layout.size.width > 0 && layout.size.height > 0;
+}
+
+static bool readNetpbmLayout(ifstream& file, Raw_Layout& layout) {  // binary P5/P6 with 8-bit samples only
+    string magic;
+    file >> magic;
+    if (magic != "P5" && magic != "P6") {
+        return false;
+    }
+    int values[3];
+    for (int& value : values) {
+        file >> ws;
+        while (file.peek() == '#') {
+            string comment;
+            getline(file, comment);
+            file >> ws;
+        }
+        file >> value;
+    }
+    file.get();     // single whitespace before the samples
+    if (!file || values[2] != 255) {
+        return false;
+    }
+    layout.size = Size(values[0], values[1]);
+    layout.channels = magic == "P6" ? 3 : 1;
+    layout.offset = file.tellg();
+    layout.stride = static_cast<size_t>(layout.size.width) * layout.channels;
+    layout.rgb = true;
+    return layout.size.width > 0 && layout.size.height > 0;
+}
+
+unique_ptr<Tile_Source> Tile_Source::open(const string& path) {
+    string extension = lowerExtension(path);
+    Raw_Layout layout;
+    {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        bool raw = extension == "bmp" ? readBmpLayout(file, layout) :
+            (extension == "ppm" || extension == "pgm" || extension == "pnm") ? readNetpbmLayout(file, layout) : false;
+        if (raw) {
+            return unique_ptr<Tile_Source>(new Raw_Tile_Source(path, layout));
+        }
+    }
+    IMAGECRAFT_TRACE("decode");
+    Mat img = imread(path);     // compressed formats cannot be decoded a tile at a time
+    if (img.empty()) {
+        throw std::runtime_error("Could not load the image from " + path);
+    }
+    return unique_ptr<Tile_Source>(new Mat_Tile_Source(img));
+}
+
+unique_ptr<Tile_Sink> Tile_Sink::create(const string& path, Size size, int type) {
+    string extension = lowerExtension(path);
+    int channels = CV_MAT_CN(type);
+    Raw_Layout layout;
+    layout.size = size;
+    layout.channels = channels;
+    if (extension == "bmp" && channels == 3) {
+        layout.stride = (static_cast<size_t>(size.width) * 3 + 3) & ~static_cast<size_t>(3);
+        layout.offset = 54;
+        layout.bottom_up = true;
+        size_t image_bytes = layout.stride * size.height;
+        string header(54, '\0');
+        auto put32 = [&](int at, uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                header[at + i] = static_cast<char>((value >> (8 * i)) & 0xff);
+            }
+        };
+        header[0] = 'B';
+        header[1] = 'M';
+        put32(2, static_cast<uint32_t>(54 + image_bytes));
+        put32(10, 54);
+        put32(14, 40);
+        put32(18, size.width);
+        put32(22, size.height);
+        header[26] = 1;     // planes
+        header[28] = 24;    // bits per pixel
+        put32(34, static_cast<uint32_t>(image_bytes));
+        return unique_ptr<Tile_Sink>(new Raw_Tile_Sink(path, header, layout));
+    }
+    if ((extension == "ppm" && channels == 3) || (extension == "pgm" && channels == 1)) {
+        string header = string(channels == 3 ? "P6" : "P5") + "\n" + to_string(size.width) + " " + to_string(size.height) + "\n255\n";
+        layout.stride = static_cast<size_t>(size.width) * channels;
+        layout.offset = header.size();
+        layout.rgb = true;
+        return unique_ptr<Tile_Sink>(new Raw_Tile_Sink(path, header, layout));
+    }
+    return unique_ptr<Tile_Sink>(new Mat_Tile_Sink(path, size, type));
+}
+
+class Tile_Engine {     // runs a chain of edits over fixed-size tiles, peak memory follows the tile budget, not the image
+public:
+    explicit Tile_Engine(size_t budget_bytes = 256ull * 1024 * 1024) : budget(budget_bytes) {}
+
+    static int halo(const vector<Edit_Op>& ops) {   // pixels each tile must read around itself so neighbourhood edits stay exact
+        int total = 0;
+        for (const Edit_Op& op : ops) {
+            if (op.geometric()) {
+                throw std::invalid_argument("Geometric edits need the whole image and cannot run tiled.");
+            }
+            total += op.reach();
+        }
+        return total;
+    }
+    int tileSize(int halo, size_t pixel_bytes) const {  // input, two intermediates and the output of one padded tile fit the budget
+        double side = sqrt(static_cast<double>(budget) / (4.0 * pixel_bytes)) - 2.0 * halo;
+        return max(64, min(4096, static_cast<int>(side) / 16 * 16));
+    }
+    void process(Tile_Source& source, const string& output_path, const vector<Edit_Op>& ops) {
+        Size size = source.size();
+        int border = halo(ops);
+        int tile = tileSize(border, CV_ELEM_SIZE(source.type()));
+        Rect bounds(0, 0, size.width, size.height);
+        unique_ptr<Tile_Sink> sink;
+
+        for (int y = 0; y < size.height; y += tile) {
+            for (int x = 0; x < size.width; x += tile) {
+                Rect core(x, y, min(tile, size.width - x), min(tile, size.height - y));
+                Rect padded = Rect(core.x - border, core.y - border, core.width + 2 * border, core.height + 2 * border) & bounds;
+                Mat pixels = source.read(padded);
+                for (const Edit_Op& op : ops) {
+                    pixels = op.applyTile(pixels, padded, size);    // image edges fall on padded edges, so borders match a full render
+                }
+                if (!sink) {
+                    sink = Tile_Sink::create(output_path, size, pixels.type());
+                }
+                sink->write(core, pixels(Rect(core.x - padded.x, core.y - padded.y, core.width, core.height)));
+            }
+        }
+        if (sink) {
+            sink->finish();
+        }
+    }
+
+private:
+    size_t budget;
+};
+
+int runTiledCommand(int argc, char* argv[]) {   // ImageCraft --tiled <input> <output> [--tile-budget-mb N] <edit>...
+    if (argc < 4) {
+        cout << "Usage: ImageCraft --tiled <input> <output> [--tile-budget-mb N] <edit>..." << endl;
+        cout << "Edits: brightness=V contrast=V blur=V filter=gray|sepia|invert color=red|green|blue|yellow text=POSITION:SIZE:RRGGBB:TEXT" << endl;
+        return 1;
+    }
+    try {
+        size_t budget = 256;
+        vector<Edit_Op> ops;
+        for (int i = 4; i < argc; i++) {
+            if (string(argv[i]) == "--tile-budget-mb" && i + 1 < argc) {
+                budget = strtoull(argv[++i], nullptr, 10);
+            }
+            else {
+                ops.push_back(Edit_Op::parse(argv[i]));
+            }
+        }
+        int64 start = getTickCount();
+        unique_ptr<Tile_Source> source = Tile_Source::open(argv[2]);
+        Tile_Engine engine(budget * 1024 * 1024);
+        engine.process(*source, argv[3], ops);
+        double seconds = (getTickCount() - start) / getTickFrequency();
+        Size size = source->size();
+        cout << "Processed " << size.width << "x" << size.height << " in " << seconds << " s using "
+            << engine.tileSize(Tile_Engine::halo(ops), CV_ELEM_SIZE(source->type())) << " px tiles" << endl;
+        return 0;
+    }
+    catch (const std::exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+class Recipe {      // a saved edit chain, one edit per line in the "name=value" form Edit_Op::parse() reads
+public:
+    static vector<Edit_Op> load(const string& path) {
+        ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Cannot read recipe " + path);
+        }
+        vector<Edit_Op> ops;
+        string line;
+        for (int number = 1; getline(file, line); number++) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            size_t first = line.find_first_not_of(" \t");
+            if (first == string::npos || line[first] == '#') {     // blank lines and comments
+                continue;
+            }
+            try {
+                ops.push_back(Edit_Op::parse(line.substr(first)));
+            }
+            catch (const std::exception& e) {
+                throw std::invalid_argument(path + ":" + to_string(number) + ": " + e.what());
+            }
+        }
+        return ops;
+    }
+    static void save(const string& path, const vector<Edit_Op>& ops) {
+        ofstream file(path);
+        file << "# ImageCraft recipe, edits run top to bottom" << endl;
+        for (const Edit_Op& op : ops) {
+            file << op.format() << endl;
+        }
+        if (!file) {
+            throw std::runtime_error("Cannot write recipe " + path);
+        }
+    }
+};
+
+struct Plan_Step {      // one pass over the image, a single edit or a run of point edits fused into one lookup table
+    vector<Edit_Op> ops;
+    Point_Op_Chain chain;
+
+    Mat run(const Mat& img) const {     // point edits use the table compiled at planning, it is not rebuilt per image
+        return ops[0].pointOp() ? chain.apply(img) : ops[0].apply(img);
+    }
+    bool view() const {     // a crop only narrows the input, no pixel is read
+        return ops.size() == 1 && (ops[0].kind == Edit_Kind::Crop || (ops[0].kind == Edit_Kind::Transform && ops[0].value == 0));
+    }
+    string describe() const {
+        string text;
+        for (const Edit_Op& op : ops) {
+            text += (text.empty() ? "" : " + ") + op.format();
+        }
+        return text;
+    }
+};
+
+struct Plan_Report {
+    int dropped = 0;        // edits that leave the image unchanged
+    int moved = 0;          // crops, rotations, flips and downscales moved ahead of other edits
+    int merged = 0;         // rotations, flips and crops folded into a neighbouring Transform
+    int fused = 0;          // point edits folded into a neighbouring lookup table
+    double recipe_passes = 0;   // estimated megapixels read running the recipe as written
+    double plan_passes = 0;     // and running the plan
+    bool fast = false;          // downscales were allowed ahead of point and colour edits
+};
+
+const char* const fast_planning_note = "Fast planning: downscales run before point and colour edits, pixels may differ from the recipe as written by a level or two";   // printed whenever --fast is given
+
+// Rewrites a recipe into fewer and smaller passes before it runs. Crops, rotations and flips move ahead of
+// pixelwise edits, a crop moves ahead of a blur by keeping the blur's halo, geometry runs become one
+// Transform, adjacent point edits share one lookup table and edits that change nothing are dropped. All of
+// these are exact. Moving a downscale ahead of point and colour edits is not, averaging before a clamped or
+// rounded mapping differs from averaging after it by a level or two, so only fast planning does it.
+class Recipe_Planner {
+public:
+    explicit Recipe_Planner(Size input, bool fast = false) : input(input), fast(fast) {}
+
+    vector<Plan_Step> plan(const vector<Edit_Op>& recipe) {
+        IMAGECRAFT_TRACE("Recipe_Planner::plan");
+        summary = Plan_Report();
+        summary.fast = fast;
+        summary.recipe_passes = passes(steps(recipe), input);
+        vector<Edit_Op> ops = recipe;
+        dropNoOps(ops);
+        moveEarly(ops);
+        mergeGeometry(ops);
+        dropNoOps(ops);
+        vector<Plan_Step> planned = fusePointOps(ops);
+        summary.plan_passes = passes(planned, input);
+        return planned;
+    }
+    const Plan_Report& report() const {
+        return summary;
+    }
+
+    static vector<Plan_Step> steps(const vector<Edit_Op>& ops) {    // the recipe as written, one pass per edit
+        vector<Plan_Step> result;
+        for (const Edit_Op& op : ops) {
+            Plan_Step step;
+            step.ops.push_back(op);
+            result.push_back(step);
+        }
+        return result;
+    }
+    static double passes(const vector<Plan_Step>& steps, Size input) {     // estimated megapixels read
+        double megapixels = 0;
+        Size size = input;
+        for (const Plan_Step& step : steps) {
+            if (!step.view()) {
+                megapixels += (step.ops[0].kind == Edit_Kind::Transform ? step.ops[0].region.area() : size.area()) / 1e6;
+            }
+            for (const Edit_Op& op : step.ops) {
+                size = op.outputSize(size);
+            }
+        }
+        return megapixels;
+    }
+    static Mat run(const vector<Plan_Step>& steps, const Mat& img, double& megapixels) {   // megapixels actually read
+        Mat result = img;
+        megapixels = 0;
+        for (const Plan_Step& step : steps) {
+            if (!step.view()) {
+                megapixels += (step.ops[0].kind == Edit_Kind::Transform ? step.ops[0].region.area() : result.total()) / 1e6;
+            }
+            result = step.run(result);
+        }
+        return result;
+    }
+
+private:
+    vector<Size> sizes(const vector<Edit_Op>& ops) const {     // sizes[i] is the input of ops[i]
+        vector<Size> result(1, input);
+        for (const Edit_Op& op : ops) {
+            result.push_back(op.outputSize(result.back()));
+        }
+        return result;
+    }
+    static bool isCrop(const Edit_Op& op) {
+        return op.kind == Edit_Kind::Crop || (op.kind == Edit_Kind::Transform && op.value == 0);
+    }
+    static bool noOp(const Edit_Op& op, Size size) {
+        Rect whole(0, 0, size.width, size.height);
+        switch (op.kind) {
+        case Edit_Kind::Resize:
+            return op.value == 100;
+        case Edit_Kind::Crop:
+            return (op.region & whole) == whole;
+        case Edit_Kind::Transform:
+            return op.value == 0 && op.region == whole;
+        case Edit_Kind::Text:
+            return op.text.empty();
+        case Edit_Kind::Color_Isolation:
+            return false;
+        case Edit_Kind::Channel_Mixer:
+            for (int i = 0; i < 9; i++) {
+                if (op.matrix.at(i) != (i % 4 == 0 ? 1.0f : 0.0f)) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return op.value == 0;   // rotate and flip state, slider value or filter index
+        }
+    }
+    bool movesBefore(const Edit_Op& op, const Edit_Op& previous) const {
+        if (!previous.pixelwise()) {
+            return false;
+        }
+        if (op.kind == Edit_Kind::Rotate || op.kind == Edit_Kind::Flip || op.kind == Edit_Kind::Crop || op.kind == Edit_Kind::Transform) {
+            return true;
+        }
+        bool linear = previous.pointOp() || previous.kind == Edit_Kind::Channel_Mixer || (previous.kind == Edit_Kind::Filter && previous.value != 0);
+        return fast && op.kind == Edit_Kind::Resize && op.value < 100 && linear;
+    }
+
+    void dropNoOps(vector<Edit_Op>& ops) {
+        vector<Size> size = sizes(ops);
+        vector<Edit_Op> kept;
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (noOp(ops[i], size[i])) {
+                summary.dropped++;
+            }
+            else {
+                kept.push_back(ops[i]);
+            }
+        }
+        ops = kept;
+    }
+    void moveEarly(vector<Edit_Op>& ops) {      // one swap at a time until nothing moves
+        for (bool changed = true; changed; ) {
+            changed = false;
+            vector<Size> size = sizes(ops);
+            for (size_t i = 1; i < ops.size() && !changed; i++) {
+                if (movesBefore(ops[i], ops[i - 1])) {
+                    std::swap(ops[i], ops[i - 1]);
+                    changed = true;
+                }
+                else if (isCrop(ops[i]) && ops[i - 1].kind == Edit_Kind::Blur && ops[i - 1].reach() > 0) {
+                    // crop first to the kept region plus the blur's reach, the blurred pixels inside it come out the same
+                    Rect whole(0, 0, size[i].width, size[i].height);
+                    Rect kept = ops[i].region & whole;
+                    int reach = ops[i - 1].reach();
+                    Rect needed = Rect(kept.x - reach, kept.y - reach, kept.width + 2 * reach, kept.height + 2 * reach) & whole;
+                    if (needed.area() < whole.area()) {
+                        Edit_Op outer = ops[i], inner = ops[i];
+                        outer.kind = inner.kind = Edit_Kind::Crop;
+                        outer.value = inner.value = 0;
+                        outer.region = needed;
+                        inner.region = kept - needed.tl();
+                        ops[i] = ops[i - 1];
+                        ops[i - 1] = outer;
+                        ops.insert(ops.begin() + i + 1, inner);
+                        changed = true;
+                    }
+                }
+                summary.moved += changed ? 1 : 0;
+            }
+        }
+    }
+    void mergeGeometry(vector<Edit_Op>& ops) {
+        vector<Size> size = sizes(ops);
+        vector<Edit_Op> merged;
+        for (size_t i = 0; i < ops.size(); ) {
+            size_t end = i + 1;
+            while (end < ops.size() && (ops[end].kind == Edit_Kind::Rotate || ops[end].kind == Edit_Kind::Flip || ops[end].kind == Edit_Kind::Crop)) {
+                end++;
+            }
+            bool starts = ops[i].kind == Edit_Kind::Rotate || ops[i].kind == Edit_Kind::Flip || ops[i].kind == Edit_Kind::Crop || ops[i].kind == Edit_Kind::Transform;
+            if (!starts || end - i < 2) {
+                merged.push_back(ops[i++]);
+                continue;
+            }
+            Edit_Op combined = ops[i].kind == Edit_Kind::Transform ? ops[i] : Edit_Op::transform(size[i]).then(ops[i]);
+            for (size_t j = i + 1; j < end; j++) {
+                combined = combined.then(ops[j]);
+            }
+            if (combined.value == 0) {      // nothing turns, a crop stays a view
+                combined.kind = Edit_Kind::Crop;
+            }
+            merged.push_back(combined);
+            summary.merged += static_cast<int>(end - i) - 1;
+            i = end;
+        }
+        ops = merged;
+    }
+    vector<Plan_Step> fusePointOps(const vector<Edit_Op>& ops) {
+        vector<Plan_Step> result;
+        for (const Edit_Op& op : ops) {
+            bool fuses = op.pointOp() && !result.empty() && result.back().ops.back().pointOp();
+            if (!fuses) {
+                result.emplace_back();
+            }
+            Plan_Step& step = result.back();
+            step.ops.push_back(op);
+            if (op.kind == Edit_Kind::Brightness) {
+                step.chain.brightness(op.value);
+            }
+            else if (op.kind == Edit_Kind::Contrast) {
+                step.chain.contrast(op.value);
+            }
+            else if (op.pointOp()) {
+                step.chain.invert();
+            }
+            summary.fused += fuses ? 1 : 0;
+        }
+        return result;
+    }
+
+    Size input;
+    bool fast;
+    Plan_Report summary;
+};
+
+int runRecipeCommand(int argc, char* argv[]) {  // ImageCraft --recipe <recipe> <input> <output> [--no-plan] [--fast] [--compare]
+    if (argc < 5) {
+        cout << "Usage: ImageCraft --recipe <recipe> <input> <output> [--no-plan] [--fast] [--compare]" << endl;
+        cout << "Recipe lines: resize=PERCENT rotate=1|-1 flip=1|-1 crop=x,y,w,h transform=x,y,w,h,ORIENTATION brightness=V contrast=V blur=V filter=gray|sepia|invert color=red|green|blue|yellow mixer=9 WEIGHTS text=POSITION:SIZE:RRGGBB:TEXT, # starts a comment" << endl;
+        return 1;
+    }
+    try {
+        bool planned = true, fast = false, compare = false;
+        for (int i = 5; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--no-plan") {
+                planned = false;
+            }
+            else if (arg == "--fast") {
+                fast = true;
+            }
+            else if (arg == "--compare") {
+                compare = true;
+            }
+            else {
+                throw std::invalid_argument("Unknown option " + arg);
+            }
+        }
+        vector<Edit_Op> recipe = Recipe::load(argv[2]);
+        Mat img = imread(argv[3], IMREAD_COLOR);
+        if (img.empty()) {
+            throw std::runtime_error(string("Cannot decode ") + argv[3]);
+        }
+        Recipe_Planner planner(img.size(), fast);
+        vector<Plan_Step> steps = planned ? planner.plan(recipe) : Recipe_Planner::steps(recipe);
+        const Plan_Report& report = planner.report();
+        for (size_t i = 0; i < steps.size(); i++) {
+            cout << "pass " << i + 1 << ": " << steps[i].describe() << (steps[i].view() ? " (view)" : "") << endl;
+        }
+        if (planned) {
+            cout << recipe.size() << " edits planned into " << steps.size() << " passes: " << report.dropped << " dropped, " << report.moved << " moved, "
+                << report.merged << " merged, " << report.fused << " fused" << endl;
+            cout << "estimated " << report.recipe_passes << " MP read as written, " << report.plan_passes << " MP planned, "
+                << report.recipe_passes - report.plan_passes << " MP saved" << endl;
+            if (report.fast) {
+                cout << fast_planning_note << endl;
+            }
+        }
+
+        double megapixels = 0;
+        int64 start = getTickCount();
+        Mat result = Recipe_Planner::run(steps, img, megapixels);
+        double ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        cout << "measured " << megapixels << " MP read in " << ms << " ms" << endl;
+        if (compare && planned) {
+            double written_megapixels = 0;
+            start = getTickCount();
+            Mat written = Recipe_Planner::run(Recipe_Planner::steps(recipe), img, written_megapixels);
+            double written_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            cout << "as written " << written_megapixels << " MP read in " << written_ms << " ms, saved " << written_megapixels - megapixels
+                << " MP and " << written_ms - ms << " ms";
+            if (written.size() == result.size() && written.type() == result.type()) {
+                cout << ", largest pixel difference " << norm(written, result, NORM_INF);
+            }
+            else {
+                cout << ", output differs in size";
+            }
+            cout << endl;
+        }
+        if (!imwrite(argv[4], result)) {
+            throw std::runtime_error(string("Cannot write ") + argv[4]);
+        }
+        return 0;
+    }
+    catch (const std::exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+bool wildcardMatch(const char* pattern, const char* name) {     // '*' and '?' like a shell glob
+    if (*pattern == '\0') {
+        return *name == '\0';
+    }
+    if (*pattern == '*') {
+        return wildcardMatch(pattern + 1, name) || (*name != '\0' && wildcardMatch(pattern, name + 1));
+    }
+    return *name != '\0' && (*pattern == '?' || *pattern == *name) && wildcardMatch(pattern + 1, name + 1);
+}
+
+// Plain paths are kept and wildcards in the file name are expanded. Outputs are named after the input file
+// alone, so a file listed twice is kept once and two inputs sharing a name, compared without case, are refused
+// before anything is written.
+vector<string> expandInputs(const vector<string>& patterns) {
+    vector<string> expanded;
+    for (const string& pattern : patterns) {
+        std::filesystem::path path(pattern);
+        string name = path.filename().string();
+        if (name.find_first_of("*?") == string::npos) {
+            expanded.push_back(pattern);
+            continue;
+        }
+        std::filesystem::path directory = path.has_parent_path() ? path.parent_path() : std::filesystem::path(".");
+        vector<string> matches;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.is_regular_file() && wildcardMatch(name.c_str(), entry.path().filename().string().c_str())) {
+                matches.push_back(entry.path().string());
+            }
+        }
+        std::sort(matches.begin(), matches.end());
+        expanded.insert(expanded.end(), matches.begin(), matches.end());
+    }
+    vector<string> files;
+    set<string> seen;
+    std::map<string, string> writers;   // lower case output name -> input written under it
+    for (const string& file : expanded) {
+        if (!seen.insert(std::filesystem::path(file).lexically_normal().string()).second) {
+            continue;
+        }
+        string name = std::filesystem::path(file).filename().string();
+        string key = name;
+        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        auto writer = writers.emplace(key, file);
+        if (!writer.second) {
+            throw std::invalid_argument(writer.first->second + " and " + file + " would both be written as " + name + " in the output directory");
+        }
+        files.push_back(file);
+    }
+    return files;
+}
+
+template <typename T>
+class Bounded_Queue {   // blocks producers while full, so a fast stage cannot run ahead of a slow one
+public:
+    explicit Bounded_Queue(size_t capacity) : capacity(max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        unique_lock<std::mutex> lock(guard);
+        if (items.size() >= capacity) {
+            int64 start = getTickCount();
+            not_full.wait(lock, [this]() { return items.size() < capacity; });
+            push_stall += getTickCount() - start;
+        }
+        items.push_back(std::move(item));
+        depth_sum += items.size();
+        pushes++;
+        not_empty.notify_one();
+    }
+    bool pop(T& item) {     // false once the queue is closed and drained
+        unique_lock<std::mutex> lock(guard);
+        if (items.empty() && !closed) {
+            int64 start = getTickCount();
+            not_empty.wait(lock, [this]() { return !items.empty() || closed; });
+            pop_stall += getTickCount() - start;
+        }
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    void close() {      // producers are done, wakes every waiting consumer
+        lock_guard<std::mutex> lock(guard);
+        closed = true;
+        not_empty.notify_all();
+    }
+    size_t size() const { return capacity; }
+    double averageDepth() const { return pushes ? static_cast<double>(depth_sum) / pushes : 0; }    // items queued right after each push
+    double pushStallSeconds() const { return push_stall / getTickFrequency(); }   // producers waiting for space
+    double popStallSeconds() const { return pop_stall / getTickFrequency(); }     // consumers waiting for items
+
+private:
+    size_t capacity;
+    deque<T> items;
+    std::mutex guard;
+    condition_variable not_full, not_empty;
+    bool closed = false;
+    long long depth_sum = 0, pushes = 0;
+    int64 push_stall = 0, pop_stall = 0;
+};
+
+class Batch_Runner {    // decode, edit and encode stages on their own threads, joined by bounded queues
+public:
+    struct Options {
+        int decoders = 2;
+        int workers = 0;    // 0 uses one worker per core
+        int encoders = 2;
+        size_t queue_depth = 4;
+        bool fast = false;      // allow approximate rewrites, see Recipe_Planner
+    };
+
+    Batch_Runner(const vector<Edit_Op>& ops, const string& output_dir, const Options& options) : ops(ops), output_dir(output_dir), options(options) {}
+
+    int run(const vector<string>& files) {     // number of files that failed
+        int cores = max(1, getNumberOfCPUs());
+        int file_count = static_cast<int>(files.size());
+        Stage decode("decode", max(1, min(options.decoders, file_count)));
+        Stage process("process", max(1, min(options.workers > 0 ? options.workers : cores, file_count)));
+        Stage encode("encode", max(1, min(options.encoders, file_count)));
+        int previous_threads = getNumThreads();
+        setNumThreads(max(1, cores / process.threads));  // OpenCV's own threads inside each worker, workers * this never exceeds the cores
+        Frame_Pool& frame_pool = Frame_Pool::instance();
+        Allocator_Scope pooled(&frame_pool);    // files of one camera decode to the same size, their frames are recycled
+        long long previous_hits = frame_pool.hits(), previous_misses = frame_pool.misses();
+        std::filesystem::create_directories(output_dir);
+
+        Bounded_Queue<Item> decoded(options.queue_depth), processed(options.queue_depth);
+        latencies.assign(files.size(), -1);
+        std::atomic<size_t> next{ 0 };
+        std::atomic<int> decoding{ decode.threads }, processing{ process.threads };
+        int64 start = getTickCount();
+        vector<thread> pool;
+        for (int i = 0; i < decode.threads; i++) {
+            pool.emplace_back([&]() {
+                for (size_t index = next++; index < files.size(); index = next++) {
+                    Item item;
+                    item.index = index;
+                    item.start = getTickCount();
+                    decode.run([&]() {
+                        IMAGECRAFT_TRACE("decode");
+                        item.image = imread(files[index], IMREAD_COLOR);
+                    });
+                    if (item.image.empty()) {
+                        report(files[index], item, "cannot decode");
+                        continue;
+                    }
+                    item.pixels = item.image.total();
+                    decoded.push(std::move(item));
+                }
+                if (--decoding == 0) {
+                    decoded.close();
+                }
+            });
+        }
+        for (int i = 0; i < process.threads; i++) {
+            pool.emplace_back([&]() {
+                Item item;
+                while (decoded.pop(item)) {
+                    string error;
+                    process.run([&]() {
+                        try {
+                            IMAGECRAFT_TRACE("process");
+                            for (const Plan_Step& step : Recipe_Planner(item.image.size(), options.fast).plan(ops)) {   // planned per file, sizes differ
+                                item.image = step.run(item.image);
+                            }
+                        }
+                        catch (const std::exception& e) {
+                            error = e.what();
+                        }
+                    });
+                    if (!error.empty()) {
+                        report(files[item.index], item, error);
+                        continue;
+                    }
+                    processed.push(std::move(item));
+                }
+                if (--processing == 0) {
+                    processed.close();
+                }
+            });
+        }
+        for (int i = 0; i < encode.threads; i++) {
+            pool.emplace_back([&]() {
+                Item item;
+                while (processed.pop(item)) {
+                    string output = (std::filesystem::path(output_dir) / std::filesystem::path(files[item.index]).filename()).string();
+                    bool written = false;
+                    encode.run([&]() {
+                        IMAGECRAFT_TRACE("encode");
+                        written = imwrite(output, item.image);
+                    });
+                    report(files[item.index], item, written ? "" : "cannot write " + output);
+                }
+            });
+        }
+        for (thread& worker : pool) {
+            worker.join();
+        }
+        double seconds = (getTickCount() - start) / getTickFrequency();
+        setNumThreads(previous_threads);
+
+        vector<double> done;
+        for (double ms : latencies) {
+            if (ms >= 0) {
+                done.push_back(ms);
+            }
+        }
+        std::sort(done.begin(), done.end());
+        cout << done.size() << " of " << files.size() << " files in " << seconds << " s: "
+            << done.size() / seconds << " files/s, " << pixels / 1e6 / seconds << " MP/s";
+        if (!done.empty()) {
+            cout << ", latency p50 " << done[done.size() / 2] << " ms, p95 " << done[(done.size() * 95) / 100] << " ms";
+        }
+        cout << endl;
+        // occupancy is the share of the wall time a stage's threads spent working, the rest was spent stalled on a queue
+        decode.print(seconds, 0, decoded.pushStallSeconds());
+        process.print(seconds, decoded.popStallSeconds(), processed.pushStallSeconds());
+        encode.print(seconds, processed.popStallSeconds(), 0);
+        cout << "decode -> process queue: average depth " << decoded.averageDepth() << " of " << decoded.size() << endl;
+        cout << "process -> encode queue: average depth " << processed.averageDepth() << " of " << processed.size() << endl;
+        cout << "frame pool: " << frame_pool.hits() - previous_hits << " hits, " << frame_pool.misses() - previous_misses << " misses" << endl;
+        return static_cast<int>(files.size() - done.size());
+    }
+
+private:
+    struct Item {
+        size_t index = 0;
+        Mat image;
+        long long pixels = 0;
+        int64 start = 0;    // decode start, latency runs to the end of encode
+    };
+    struct Stage {
+        Stage(const string& name, int threads) : name(name), threads(threads) {}
+        void run(const function<void()>& work) {
+            int64 start = getTickCount();
+            work();
+            busy += getTickCount() - start;
+        }
+        void print(double seconds, double input_stall, double output_stall) const {
+            cout << name << ": " << threads << " threads, occupancy " << 100.0 * busy / getTickFrequency() / (seconds * threads)
+                << "%, stalled " << input_stall << " s waiting for input, " << output_stall << " s waiting for output" << endl;
+        }
+        string name;
+        int threads;
+        std::atomic<int64> busy{ 0 };
+    };
+
+    void report(const string& file, const Item& item, const string& error) {
+        double ms = (getTickCount() - item.start) * 1000.0 / getTickFrequency();
+        lock_guard<std::mutex> lock(output);
+        if (error.empty()) {
+            latencies[item.index] = ms;
+            pixels += item.pixels;
+            cout << file << ": " << ms << " ms" << endl;
+        }
+        else {
+            cout << file << ": failed, " << error << endl;
+        }
+    }
+
+    vector<Edit_Op> ops;
+    string output_dir;
+    Options options;
+    std::mutex output;
+    vector<double> latencies;   // per file, -1 when it failed
+    long long pixels = 0;
+};
+
+int runBatchCommand(int argc, char* argv[]) {   // ImageCraft --batch <output_dir> [--threads N] [--decoders N] [--encoders N] [--queue-depth N] [--fast] <input|glob>... -- <edit|@recipe>...
+    if (argc < 4) {
+        cout << "Usage: ImageCraft --batch <output_dir> [--threads N] [--decoders N] [--encoders N] [--queue-depth N] [--fast] <input|glob>... -- <edit|@recipe>..." << endl;
+        cout << "Edits: resize=PERCENT rotate=1|-1 flip=1|-1 crop=x,y,w,h brightness=V contrast=V blur=V filter=gray|sepia|invert color=red|green|blue|yellow mixer=9 WEIGHTS text=POSITION:SIZE:RRGGBB:TEXT" << endl;
+        return 1;
+    }
+    try {
+        Batch_Runner::Options options;
+        vector<string> patterns;
+        vector<Edit_Op> ops;
+        bool edits = false;
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (edits && arg[0] == '@') {
+                vector<Edit_Op> recipe = Recipe::load(arg.substr(1));
+                ops.insert(ops.end(), recipe.begin(), recipe.end());
+            }
+            else if (edits) {
+                ops.push_back(Edit_Op::parse(arg));
+            }
+            else if (arg == "--") {
+                edits = true;
+            }
+            else if (arg == "--threads" && i + 1 < argc) {
+                options.workers = atoi(argv[++i]);
+            }
+            else if (arg == "--fast") {
+                options.fast = true;
+            }
+            else if (arg == "--decoders" && i + 1 < argc) {
+                options.decoders = atoi(argv[++i]);
+            }
+            else if (arg == "--encoders" && i + 1 < argc) {
+                options.encoders = atoi(argv[++i]);
+            }
+            else if (arg == "--queue-depth" && i + 1 < argc) {
+                options.queue_depth = strtoull(argv[++i], nullptr, 10);
+            }
+            else {
+                patterns.push_back(arg);
+            }
+        }
+        vector<string> files = expandInputs(patterns);
+        if (files.empty()) {
+            throw std::invalid_argument("No input files matched.");
+        }
+        if (options.fast) {
+            cout << fast_planning_note << endl;
+        }
+        return Batch_Runner(ops, argv[2], options).run(files) > 0 ? 2 : 0;
+    }
+    catch (const std::exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+class Frame_Sequence {      // numbered stills named by a printf pattern, e.g. frames/%05d.png
+public:
+    explicit Frame_Sequence(const string& pattern) : pattern(pattern) {}
+
+    static bool isPattern(const string& path) {
+        return path.find('%') != string::npos;
+    }
+    string path(int index) const {
+        char name[4096];
+        snprintf(name, sizeof(name), pattern.c_str(), index);
+        return name;
+    }
+    int first() const {     // sequences are numbered from 0 or from 1
+        for (int index = 0; index <= 1; index++) {
+            if (std::filesystem::exists(path(index))) {
+                return index;
+            }
+        }
+        throw std::runtime_error("No frame matches " + pattern);
+    }
+
+private:
+    string pattern;
+};
+
+// Runs one edit chain over every frame of a video or a frame sequence. A reader decodes video frames in order
+// (sequence frames are decoded by the workers), workers edit frames in parallel and a writer puts them back in
+// order before encoding. The chain is planned once per worker and frame size, so lookup tables and merged
+// geometry are built once rather than per frame. At most `window` frames are between reader and writer, a slow
+// frame holds the reader back instead of letting finished frames pile up behind it.
+class Frame_Executor {
+public:
+    struct Options {
+        int workers = 0;    // 0 uses one worker per core
+        size_t queue_depth = 8;
+        double fps = 0;     // output rate, 0 keeps the input's, 25 for sequences
+        bool fast = false;  // allow approximate rewrites, see Recipe_Planner
+    };
+
+    Frame_Executor(const vector<Edit_Op>& ops, const Options& options) : ops(ops), options(options) {}
+
+    int run(const string& input, const string& output) {  // frames written
+        bool sequence_in = Frame_Sequence::isPattern(input), sequence_out = Frame_Sequence::isPattern(output);
+        Frame_Sequence input_frames(input), output_frames(output);
+        VideoCapture capture;
+        int first = 0;
+        double fps = options.fps;
+        if (sequence_in) {
+            first = input_frames.first();
+            fps = fps > 0 ? fps : 25;
+        }
+        else {
+            if (!capture.open(input)) {
+                throw std::runtime_error("Cannot open video " + input);
+            }
+            fps = fps > 0 ? fps : (capture.get(CAP_PROP_FPS) > 0 ? capture.get(CAP_PROP_FPS) : 25);
+        }
+        if (sequence_out) {
+            std::filesystem::path directory = std::filesystem::path(output_frames.path(0)).parent_path();
+            if (!directory.empty()) {
+                std::filesystem::create_directories(directory);
+            }
+        }
+
+        int cores = max(1, getNumberOfCPUs());
+        int workers = max(1, options.workers > 0 ? options.workers : cores);
+        int previous_threads = getNumThreads();
+        setNumThreads(max(1, cores / workers));  // OpenCV's own threads inside each worker, workers * this never exceeds the cores
+        Allocator_Scope pooled(&Frame_Pool::instance());   // every frame has the size of the last, buffers go round
+        window = options.queue_depth * 2 + workers;
+
+        Bounded_Queue<Frame> decoded(options.queue_depth), processed(options.queue_depth);
+        std::atomic<int> processing{ workers };
+        int64 start = getTickCount();
+        vector<thread> pool;
+        pool.emplace_back([&]() {   // reader
+            for (int index = 0; !failed(); index++) {
+                Frame frame;
+                frame.index = index;
+                if (sequence_in) {
+                    if (!std::filesystem::exists(input_frames.path(first + index))) {
+                        break;
+                    }
+                }
+                else {
+                    IMAGECRAFT_TRACE("decode");
+                    if (!capture.read(frame.image) || frame.image.empty()) {
+                        break;
+                    }
+                }
+                reserve(index);
+                decoded.push(std::move(frame));
+            }
+            decoded.close();
+        });
+        for (int i = 0; i < workers; i++) {
+            pool.emplace_back([&]() {
+                Size planned_size;
+                vector<Plan_Step> steps;
+                Frame frame;
+                while (decoded.pop(frame)) {
+                    try {
+                        IMAGECRAFT_TRACE("process");
+                        if (sequence_in) {
+                            frame.image = imread(input_frames.path(first + frame.index), IMREAD_COLOR);
+                            if (frame.image.empty()) {
+                                throw std::runtime_error("cannot decode " + input_frames.path(first + frame.index));
+                            }
+                        }
+                        if (frame.image.size() != planned_size) {
+                            planned_size = frame.image.size();
+                            steps = Recipe_Planner(planned_size, options.fast).plan(ops);
+                        }
+                        for (const Plan_Step& step : steps) {
+                            frame.image = step.run(frame.image);
+                        }
+                        if (sequence_out && !imwrite(output_frames.path(first + frame.index), frame.image)) {   // stills need no order
+                            throw std::runtime_error("cannot write " + output_frames.path(first + frame.index));
+                        }
+                    }
+                    catch (const std::exception& e) {
+                        fail("frame " + to_string(frame.index) + ": " + e.what());
+                    }
+                    processed.push(std::move(frame));
+                }
+                if (--processing == 0) {
+                    processed.close();
+                }
+            });
+        }
+
+        VideoWriter writer;
+        std::map<int, Frame> waiting;   // finished ahead of an earlier frame
+        vector<double> written_at;      // seconds since start, per frame in order
+        double last_report = 0;
+        Frame frame;
+        while (processed.pop(frame)) {  // writer, on this thread
+            waiting[frame.index] = std::move(frame);
+            for (auto next = waiting.find(next_index); next != waiting.end(); next = waiting.find(next_index)) {
+                if (!sequence_out && !failed()) {
+                    IMAGECRAFT_TRACE("encode");
+                    Mat& image = next->second.image;
+                    if (!writer.isOpened() && !writer.open(output, fourcc(output), fps, image.size())) {
+                        fail("cannot write " + output);
+                    }
+                    else {
+                        writer.write(image);
+                    }
+                }
+                waiting.erase(next);
+                double seconds = (getTickCount() - start) / getTickFrequency();
+                written_at.push_back(seconds);
+                advance();
+                if (seconds - last_report >= 1) {
+                    last_report = seconds;
+                    cout << "frame " << written_at.size() << ", " << written_at.size() / seconds << " fps" << endl;
+                }
+            }
+        }
+        for (thread& worker : pool) {
+            worker.join();
+        }
+        writer.release();
+        double seconds = (getTickCount() - start) / getTickFrequency();
+        setNumThreads(previous_threads);
+        if (failed()) {
+            throw std::runtime_error(error);
+        }
+
+        // sustained rate is the slowest whole second, the overall rate hides a stall behind a fast start
+        double slowest = 0;
+        for (int second = 1; second <= static_cast<int>(seconds); second++) {
+            double frames = static_cast<double>(std::upper_bound(written_at.begin(), written_at.end(), static_cast<double>(second))
+                - std::upper_bound(written_at.begin(), written_at.end(), second - 1.0));
+            slowest = second == 1 ? frames : min(slowest, frames);
+        }
+        double overall = written_at.size() / seconds;
+        cout << written_at.size() << " frames in " << seconds << " s with " << workers << " workers: " << overall << " fps";
+        if (seconds >= 1) {
+            cout << ", sustained " << slowest << " fps";
+        }
+        cout << ", " << overall / fps << "x real time at " << fps << " fps" << endl;
+        return static_cast<int>(written_at.size());
+    }
+
+private:
+    struct Frame {
+        int index = 0;
+        Mat image;
+    };
+
+    static int fourcc(const string& path) {
+        return lowerExtension(path) == "avi" ? VideoWriter::fourcc('M', 'J', 'P', 'G') : VideoWriter::fourcc('m', 'p', '4', 'v');
+    }
+    void reserve(int index) {   // the reader waits while the window is full
+        unique_lock<std::mutex> lock(guard);
+        window_open.wait(lock, [&]() { return index < next_index + static_cast<int>(window) || !error.empty(); });
+    }
+    void advance() {
+        lock_guard<std::mutex> lock(guard);
+        next_index++;
+        window_open.notify_all();
+    }
+    void fail(const string& message) {  // the first error stops the reader, frames in flight drain
+        lock_guard<std::mutex> lock(guard);
+        if (error.empty()) {
+            error = message;
+        }
+        window_open.notify_all();
+    }
+    bool failed() {
+        lock_guard<std::mutex> lock(guard);
+        return !error.empty();
+    }
+
+    vector<Edit_Op> ops;
+    Options options;
+    size_t window = 0;
+    std::mutex guard;
+    condition_variable window_open;
+    int next_index = 0;     // next frame the writer needs
+    string error;
+};
+
+int runVideoCommand(int argc, char* argv[]) {   // ImageCraft --video <input> <output> [--threads N] [--queue-depth N] [--fps F] [--fast] <edit|@recipe>...
+    if (argc < 4) {
+        cout << "Usage: ImageCraft --video <input> <output> [--threads N] [--queue-depth N] [--fps F] [--fast] <edit|@recipe>..." << endl;
+        cout << "Input and output are video files or numbered frames such as frames/%05d.png" << endl;
+        cout << "Edits: resize=PERCENT rotate=1|-1 flip=1|-1 crop=x,y,w,h brightness=V contrast=V blur=V filter=gray|sepia|invert color=red|green|blue|yellow mixer=9 WEIGHTS text=POSITION:SIZE:RRGGBB:TEXT" << endl;
+        return 1;
+    }
+    try {
+        Frame_Executor::Options options;
+        vector<Edit_Op> ops;
+        for (int i = 4; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc) {
+                options.workers = atoi(argv[++i]);
+            }
+            else if (arg == "--queue-depth" && i + 1 < argc) {
+                options.queue_depth = strtoull(argv[++i], nullptr, 10);
+            }
+            else if (arg == "--fps" && i + 1 < argc) {
+                options.fps = strtod(argv[++i], nullptr);
+            }
+            else if (arg == "--fast") {
+                options.fast = true;
+            }
+            else if (arg[0] == '@') {
+                vector<Edit_Op> recipe = Recipe::load(arg.substr(1));
+                ops.insert(ops.end(), recipe.begin(), recipe.end());
+            }
+            else {
+                ops.push_back(Edit_Op::parse(arg));
+            }
+        }
+        if (options.fast) {
+            cout << fast_planning_note << endl;
+        }
+        return Frame_Executor(ops, options).run(argv[2], argv[3]) > 0 ? 0 : 2;
+    }
+    catch (const std::exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// Counts Mat buffers handed out while installed as the default allocator. The buffers come from Frame_Pool,
+// which the GUI, batch and video modes install too, so benchmark times include the same reuse; the count is
+// every buffer a call requests, whether the pool recycled it or not.
+class Counting_Allocator : public MatAllocator {
+public:
+    Counting_Allocator() : inner(&Frame_Pool::instance()) {}
+
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, AccessFlag flags, UMatUsageFlags usage) const override {
+        count++;
+        return inner->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+    bool allocate(UMatData* data, AccessFlag flags, UMatUsageFlags usage) const override {
+        return inner->allocate(data, flags, usage);
+    }
+    void deallocate(UMatData* data) const override {
+        inner->deallocate(data);
+    }
+    long long allocations() const { return count; }
+
+private:
+    MatAllocator* inner;
+    mutable std::atomic<long long> count{ 0 };
+};
+
+struct Bench_Result {
+    string name;
+    double megapixels = 0;
+    int channels = 0;
+    int value = 0;          // slider value or state the method ran with, 0 when it has none
+    double ms = 0;          // median time per call
+    double mpix_per_s = 0;  // input megapixels per second
+    double allocations = 0; // Mat allocations per call
+};
+
+class Benchmark {       // times every Image_Filters and Image_Operations method and the display conversion
+public:
+    explicit Benchmark(const vector<double>& megapixels, double min_seconds = 0.25) : sizes(megapixels), min_seconds(min_seconds) {}
+
+    vector<Bench_Result> run() {
+        Counting_Allocator counter;     // first, every Mat below is released through it before it goes
+        Allocator_Scope scope(&counter);
+        Image_Filters filters;
+        Image_Operations operations;
+        Display_Surface surface;
+        Tile_Viewport viewport;
+        const int channels[] = { 1, 3, 4 };
+        vector<Bench_Result> results;
+        for (double megapixels : sizes) {
+            int width = cvRound(sqrt(megapixels * 1e6 * 4 / 3));   // 4:3 like most camera sensors
+            int height = cvRound(width * 3 / 4.0);
+            for (int cn : channels) {
+                Mat img(height, width, CV_8UC(cn));
+                setRNGSeed(1);
+                randu(img, Scalar::all(0), Scalar::all(256));
+                auto add = [&](const string& name, int value, const function<Mat(Mat&)>& call) {
+                    Bench_Result result;
+                    if (measure(img, counter, call, result)) {
+                        result.name = name;
+                        result.megapixels = megapixels;
+                        result.channels = cn;
+                        result.value = value;
+                        results.push_back(result);
+                        cout << name << " " << megapixels << " MP " << cn << " ch value " << value << ": "
+                            << result.mpix_per_s << " MP/s, " << result.allocations << " allocations" << endl;
+                    }
+                };
+                for (int value : { -50, 50 }) {
+                    add("Image_Filters::brightness_adjustment", value, [&](Mat& m) { return filters.brightness_adjustment(m, value); });
+                    add("Image_Filters::contrast_adjustment", value, [&](Mat& m) { return filters.contrast_adjustment(m, value); });
+                }
+                for (int value : { -50, 3, 20, 100 }) {
+                    add("Image_Filters::blur_adjustment", value, [&](Mat& m) { return filters.blur_adjustment(m, value); });
+                }
+                add("Image_Filters::gray_filter", 0, [&](Mat& m) { return filters.gray_filter(m); });
+                add("Image_Filters::gray_bgr_filter", 0, [&](Mat& m) { return filters.gray_bgr_filter(m); });
+                add("Image_Filters::sepia_filter", 0, [&](Mat& m) { return filters.sepia_filter(m); });
+                add("Image_Filters::color_inversion", 0, [&](Mat& m) { return filters.color_inversion(m); });
+                for (int value : { 0, 3 }) {
+                    add("Image_Filters::color_isolation", value, [&](Mat& m) { return filters.color_isolation(m, value); });
+                }
+                for (int value : { 25, 75 }) {
+                    add("Image_Operations::resizeImage", value, [&](Mat& m) { return operations.resizeImage(m, value); });
+                }
+                for (int value : { -1, 1 }) {
+                    add("Image_Operations::rotateimage", value, [&](Mat& m) { return operations.rotateimage(m, value); });
+                    add("Image_Operations::flipimage", value, [&](Mat& m) { return operations.flipimage(m, value); });
+                }
+                Mip_Pyramid pyramid;
+                pyramid.build(img);
+                for (int value : { 25, 75 }) {
+                    add("Mip_Pyramid::at", value, [&](Mat&) { return pyramid.at(value / 100.0); });
+                }
+                add("Image_Operations::previewProxy", 600, [&](Mat& m) {
+                    double scale;
+                    return operations.previewProxy(m, 600, 600, scale);
+                });
+                add("ImageCraft::MatToQImage", 0, [&](Mat& m) {
+                    ImageCraft::MatToQImage(m);
+                    return m;
+                });
+                add("Display_Surface::present", 600, [&](Mat& m) {
+                    surface.present(m, 600, 600);
+                    return m;
+                });
+                add("Tile_Viewport::render", 100, [&](Mat& m) {     // cold cache at 100% zoom, cost follows the view, not the image
+                    viewport.setImage(m);
+                    viewport.zoomAt(1.0 / viewport.scale(Size(600, 600)), Point2d(0, 0), Size(600, 600));
+                    viewport.render(Size(600, 600));
+                    return m;
+                });
+            }
+        }
+        return results;
+    }
+
+    static void save(const string& path, const vector<Bench_Result>& results) {
+        FileStorage fs(path, FileStorage::WRITE | FileStorage::FORMAT_JSON);
+        if (!fs.isOpened()) {
+            throw std::runtime_error("Cannot write " + path);
+        }
+        fs << "opencv" << CV_VERSION << "threads" << getNumThreads();
+        fs << "results" << "[";
+        for (const Bench_Result& r : results) {
+            fs << "{" << "name" << r.name << "megapixels" << r.megapixels << "channels" << r.channels << "value" << r.value
+                << "ms" << r.ms << "mpix_per_s" << r.mpix_per_s << "allocations" << r.allocations << "}";
+        }
+        fs << "]";
     }
-    Mat rotateimage(Mat& img, int state) {
-        if (img.empty()) {
-            throw std::runtime_error("Image is empty, cannot rotate.");
+    static vector<Bench_Result> load(const string& path) {
+        FileStorage fs(path, FileStorage::READ | FileStorage::FORMAT_JSON);
+        if (!fs.isOpened()) {
+            throw std::runtime_error("Cannot read " + path);
         }
-        Mat rotatedImg;
-        if (state == 1) {   // clockwise state
-            rotate(img, rotatedImg, ROTATE_90_CLOCKWISE);
+        vector<Bench_Result> results;
+        FileNode list = fs["results"];
+        for (FileNodeIterator it = list.begin(); it != list.end(); ++it) {
+            FileNode node = *it;
+            Bench_Result r;
+            r.name = static_cast<string>(node["name"]);
+            r.megapixels = static_cast<double>(node["megapixels"]);
+            r.channels = static_cast<int>(node["channels"]);
+            r.value = static_cast<int>(node["value"]);
+            r.ms = static_cast<double>(node["ms"]);
+            r.mpix_per_s = static_cast<double>(node["mpix_per_s"]);
+            r.allocations = static_cast<double>(node["allocations"]);
+            results.push_back(r);
         }
-        else if (state == -1) {     // anticlockwise state
-            rotate(img, rotatedImg, ROTATE_90_COUNTERCLOCKWISE);
+        return results;
+    }
+    static int compare(const vector<Bench_Result>& baseline, const vector<Bench_Result>& current, double threshold_percent) {   // number of regressions
+        int regressions = 0;
+        for (const Bench_Result& now : current) {
+            for (const Bench_Result& before : baseline) {
+                if (before.name != now.name || before.channels != now.channels || before.value != now.value || abs(before.megapixels - now.megapixels) > 1e-9) {
+                    continue;
+                }
+                double change = (now.mpix_per_s / before.mpix_per_s - 1) * 100;
+                bool slower = change < -threshold_percent;
+                bool allocates_more = now.allocations > before.allocations;
+                if (slower || allocates_more) {
+                    regressions++;
+                    cout << "REGRESSION ";
+                }
+                else {
+                    cout << "ok         ";
+                }
+                cout << now.name << " " << now.megapixels << " MP " << now.channels << " ch value " << now.value << ": "
+                    << before.mpix_per_s << " -> " << now.mpix_per_s << " MP/s (" << change << "%), "
+                    << before.allocations << " -> " << now.allocations << " allocations" << endl;
+            }
         }
-        return rotatedImg;
+        cout << regressions << " regression(s) beyond " << threshold_percent << "%" << endl;
+        return regressions;
     }
-    Mat flipimage(Mat& img, int state) {
-        if (img.empty()) {
-            throw std::runtime_error("Image is empty, cannot flip.");
+
+private:
+    bool measure(Mat& img, const Counting_Allocator& counter, const function<Mat(Mat&)>& call, Bench_Result& result) const {
+        long long before = counter.allocations();
+        try {
+            call(img);      // warm-up, also tells whether the method supports this channel count
         }
-        Mat flippedImg;
-        if (state == -1) {
-            flip(img, flippedImg, 0);       // flip vertically
+        catch (const std::exception&) {
+            return false;
         }
-        else if (state == 1) {
-            flip(img, flippedImg, 1);       // flip horizontally
+        result.allocations = static_cast<double>(counter.allocations() - before);
+        vector<double> times;
+        double total = 0;
+        while (times.size() < 3 || total < min_seconds) {
+            int64 start = getTickCount();
+            call(img);
+            double seconds = (getTickCount() - start) / getTickFrequency();
+            times.push_back(seconds);
+            total += seconds;
         }
-        return flippedImg;
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        result.ms = median * 1000;
+        result.mpix_per_s = img.total() / 1e6 / median;
+        return true;
     }
+
+    vector<double> sizes;
+    double min_seconds;
 };
 
+int runBenchmarkCommand(int argc, char* argv[]) {   // ImageCraft --bench [--sizes 1,4,16,50,100] [--out FILE] [--baseline FILE] [--threshold PERCENT]
+    try {
+        vector<double> sizes = { 1, 4, 16, 50, 100 };
+        string out_path = "imagecraft_bench.json";
+        string baseline_path;
+        double threshold = 10;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--sizes" && i + 1 < argc) {
+                sizes.clear();
+                for (char* p = argv[++i]; *p; ) {
+                    sizes.push_back(strtod(p, &p));
+                    if (*p == ',') {
+                        p++;
+                    }
+                    else if (*p) {
+                        throw std::invalid_argument("--sizes takes comma separated megapixels");
+                    }
+                }
+            }
+            else if (arg == "--out" && i + 1 < argc) {
+                out_path = argv[++i];
+            }
+            else if (arg == "--baseline" && i + 1 < argc) {
+                baseline_path = argv[++i];
+            }
+            else if (arg == "--threshold" && i + 1 < argc) {
+                threshold = strtod(argv[++i], nullptr);
+            }
+            else {
+                cout << "Usage: ImageCraft --bench [--sizes 1,4,16,50,100] [--out FILE] [--baseline FILE] [--threshold PERCENT]" << endl;
+                return 1;
+            }
+        }
+        vector<Bench_Result> results = Benchmark(sizes).run();
+        Benchmark::save(out_path, results);
+        cout << "Wrote " << results.size() << " results to " << out_path << endl;
+        if (!baseline_path.empty()) {
+            return Benchmark::compare(Benchmark::load(baseline_path), results, threshold) > 0 ? 2 : 0;
+        }
+        return 0;
+    }
+    catch (const std::exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+}
+
 Image Imag1;        // universal object of the image class
-Mat universal_image;        // universal image
+Mat universal_image;        // universal image, the rendered output of edit_graph
+Memory_Budget memory_budget;    // ceiling set by IMAGECRAFT_MEMORY_MB, declared before edit_graph so its scratch file outlives the nodes
+Edit_Graph edit_graph;      // every edit made on top of original_image
+Undo_History undo_history;  // Ctrl+Z / Ctrl+Y, budget set by IMAGECRAFT_UNDO_BUDGET_MB
+Render_Worker render_worker;    // background renderer for slider previews
+Slider_Precomputer slider_precomputer(render_worker);  // neighbouring slider positions, rendered while render_worker is idle
+Tile_Viewport viewport;     // frames shown from the GUI thread, zoomed and panned over universal_image
+Overlay_Layer* overlay_layer = nullptr;     // selection and guides above ui.uploaded_pic, owned by the window
+Display_Surface preview_surface;    // frames rendered by render_worker
+Import_Decoders import_decoders;    // full-resolution decodes behind reduced JPEG previews
+unique_ptr<Allocator_Scope> frame_pool_scope;   // Frame_Pool is the default allocator while the window is open
+int import_generation = 0;  // bumped by every import and on close, a queued full decode of an older one is dropped
+
+// Slider edits are previewed on a display-sized proxy and only rendered at full resolution on commit.
+// Brightness, contrast and blur previews stay within preview_tolerance of the area-downsampled full render.
+const double preview_tolerance = 1.0;  // max mean absolute difference in 8-bit levels, checked in debug builds
+Mat preview_proxy;          // display-sized copy of the input of the edit the visible slider changes
+Mip_Pyramid resize_pyramid; // the proxy at every halving while the resize slider is shown
+double preview_scale = 1.0; // proxy width divided by full resolution width
+int preview_node = -1;      // edit graph node the visible slider changes, -1 appends a new node on commit
+Edit_Op pending_op;         // slider edit shown on the proxy but not yet rendered
+bool pending_edit = false;
+
+void ImageCraft::enforceMemoryBudget() {    // called whenever an edit, undo or import changed what is held
+    if (!memory_budget.enforce(edit_graph, undo_history, { &original_image, &universal_image, &preview_proxy })) {
+        double mb = 1024.0 * 1024.0;
+        ui.statusBar->showMessage(tr("Memory ceiling of %1 MB cannot be met, %2 MB are needed by the image, its current render and edit state")
+            .arg(memory_budget.ceiling() / mb, 0, 'f', 0).arg(memory_budget.resident() / mb, 0, 'f', 0), 5000);
+    }
+}
+
+bool exportLossless(const string& output, string& reason) {     // geometry-only edits of a JPEG are written without re-encoding
+#ifdef IMAGECRAFT_HAVE_LIBJPEG
+    string in_extension = lowerExtension(original_path), out_extension = lowerExtension(output);
+    if ((in_extension != "jpg" && in_extension != "jpeg") || (out_extension != "jpg" && out_extension != "jpeg")) {
+        reason = "not a JPEG to JPEG export";
+        return false;
+    }
+    Edit_Op geometry = Edit_Op::transform(original_image.size());
+    if (edit_graph.size() == 1 && edit_graph.op(0).kind == Edit_Kind::Transform) {
+        geometry = edit_graph.op(0);
+    }
+    else if (edit_graph.size() != 0) {
+        reason = "the edits change pixels";
+        return false;
+    }
+    IMAGECRAFT_TRACE("encode lossless");
+    return Jpeg_Lossless::transform(original_path, output, geometry.region, geometry.value, reason);
+#else
+    (void)output;
+    reason = "built without libjpeg";
+    return false;
+#endif
+}
 
 void ImageCraft::hideSliders() {    // hide sliders and buttons when not needed
     ui.Brightness_Slider->setVisible(false);
@@ -229,6 +4309,10 @@ void ImageCraft::hideSliders() {    // hide sliders and buttons when not needed
     ui.rotateacw->setVisible(false);
     ui.vertflip->setVisible(false);
     ui.horiflip->setVisible(false);
+    preview_node = -1;      // hidden sliders no longer edit anything
+    preview_proxy.release();
+    resize_pyramid.release();
+    slider_precomputer.end();
 }
 
 ImageCraft::ImageCraft(QWidget* parent) : QMainWindow(parent) {
@@ -241,44 +4325,327 @@ ImageCraft::ImageCraft(QWidget* parent) : QMainWindow(parent) {
     ui.vertflip->setIcon(QIcon("vertflip.png"));
     ui.horiflip->setIcon(QIcon("horiflip.png"));
 
-    // connect sliders with their respective handlers
-    connect(ui.Contrast_Slider, &QScrollBar::valueChanged, this, &ImageCraft::on_Contrast_Slider_valueChanged);
-    connect(ui.Filter_ComboBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &ImageCraft::on_Filter_ComboBox_currentIndexChanged);
-    connect(ui.Color_ComboBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &ImageCraft::on_Color_ComboBox_currentIndexChanged);
-    connect(ui.Resize_Slider, &QScrollBar::valueChanged, this, &ImageCraft::on_Resize_Slider_valueChanged);
-    connect(ui.Brightness_Slider, &QScrollBar::valueChanged, this, &ImageCraft::on_Brightness_Slider_valueChanged);
-    connect(ui.AddText_Button, &QPushButton::clicked, this, &ImageCraft::on_AddText_Button_clicked);
+    // sliders, combo boxes and buttons are connected to their on_<name>_<signal> handlers by setupUi,
+    // connecting them again here would run every handler twice per event
+    connect(new QShortcut(QKeySequence::Undo, this), &QShortcut::activated, this, &ImageCraft::undoEdit);
+    connect(new QShortcut(QKeySequence::Redo, this), &QShortcut::activated, this, &ImageCraft::redoEdit);
+    connect(new QShortcut(QKeySequence(tr("Ctrl+Shift+S")), this), &QShortcut::activated, this, &ImageCraft::saveRecipe);
+    connect(new QShortcut(QKeySequence(tr("Ctrl+Shift+O")), this), &QShortcut::activated, this, &ImageCraft::loadRecipe);
+    connect(new QShortcut(QKeySequence(tr("Ctrl+0")), this), &QShortcut::activated, this, &ImageCraft::zoomToFit);
+    connect(new QShortcut(QKeySequence(tr("Ctrl+1")), this), &QShortcut::activated, this, &ImageCraft::zoomToActualSize);
+    if (const char* budget = getenv("IMAGECRAFT_UNDO_BUDGET_MB")) {
+        undo_history.setBudget(strtoull(budget, nullptr, 10) * 1024 * 1024);
+    }
+    undo_history.setBudget(min(undo_history.budgetBytes(), memory_budget.ceiling()));  // the history alone never exceeds the ceiling
+    // slider ticks reuse the frames of the previous tick; buffers under 64 KB pass straight through to fastMalloc
+    frame_pool_scope.reset(new Allocator_Scope(&Frame_Pool::instance()));
+    overlay_layer = new Overlay_Layer(ui.uploaded_pic->parentWidget());
+    overlay_layer->setGeometry(ui.uploaded_pic->geometry());
+    overlay_layer->raise();
+}
+ImageCraft::~ImageCraft() {
+    slider_precomputer.stop();
+    render_worker.stop();   // no frames may be posted to a destroyed window
+    import_generation++;    // a full decode still queued must not touch the window
+    import_decoders.joinAll();  // superseded decodes still post to this window, they finish first
+    frame_pool_scope.reset();   // nothing renders any more, the previous allocator is back for whatever outlives the window
+}
+
+void ImageCraft::renderPreview(std::function<cv::Mat()> render) {  // render on the worker, show the newest finished frame
+    int width = current_image_width;
+    int height = current_image_height;
+    int64 input_tick = IMAGECRAFT_INPUT_TICK();     // the slider moved, latency runs until its frame is on the label
+    render_worker.submit(this, [render, width, height](const function<bool()>& cancelled) {
+        IMAGECRAFT_TRACE("preview render");
+        Mat edited = render();
+        if (cancelled()) {
+            return QImage();    // a newer slider value arrived, skip the display conversion
+        }
+        return preview_surface.present(edited, width, height);
+    }, [this, input_tick](const QImage& frame) {
+        ui.uploaded_pic->setPixmap(QPixmap::fromImage(frame));
+        IMAGECRAFT_DISPLAYED(input_tick, ui.statusBar);
+    });
+}
+
+void ImageCraft::showImage(const cv::Mat& img) {   // only display-sized pixels are touched, whatever the image size
+    viewport.setImage(img);
+    showViewport();
+}
+void ImageCraft::showViewport() {
+    ui.uploaded_pic->setPixmap(QPixmap::fromImage(viewport.render(viewportSize())));
+}
+cv::Size ImageCraft::viewportSize() const {    // the fitted size the sliders set, or the whole label while zoomed
+    QRect contents = ui.uploaded_pic->contentsRect();
+    return viewport.zoomed() ? Size(contents.width(), contents.height()) : Size(current_image_width, current_image_height);
+}
+QRect ImageCraft::labelRect(const cv::Rect& image_rect) const {    // an image rectangle where the label currently shows it
+    QRect contents = ui.uploaded_pic->contentsRect();
+    Point2d middle(contents.x() + contents.width() / 2.0, contents.y() + contents.height() / 2.0);
+    Point2d top_left = middle + viewport.fromImage(Point2d(image_rect.x, image_rect.y), viewportSize());
+    Point2d bottom_right = middle + viewport.fromImage(Point2d(image_rect.x + image_rect.width, image_rect.y + image_rect.height), viewportSize());
+    return QRect(QPoint(cvRound(top_left.x), cvRound(top_left.y)), QPoint(cvRound(bottom_right.x) - 1, cvRound(bottom_right.y) - 1));
+}
+cv::Point2d ImageCraft::viewportOffset(QPoint label_point) const {     // from the middle of the label, where frames are centered
+    QRect contents = ui.uploaded_pic->contentsRect();
+    return Point2d(label_point.x() - contents.x() - contents.width() / 2.0, label_point.y() - contents.y() - contents.height() / 2.0);
+}
+void ImageCraft::zoomViewport(double factor, QPoint label_point) {
+    if (!Imag1.isImageLoaded()) {
+        return;
+    }
+    commitPendingEdit();    // the view shows committed pixels only
+    if (factor > 0) {
+        viewport.zoomAt(factor, viewportOffset(label_point), viewportSize());
+    }
+    else {
+        viewport.fit();
+    }
+    selectionRect = QRect();    // it was drawn over the previous view
+    overlay_layer->setSelection(selectionRect);
+    showViewport();
+    ui.statusBar->showMessage(tr("Zoom %1%, tiles: %2 reused, %3 rendered, %4 MB cached").arg(viewport.scale(viewportSize()) * 100, 0, 'f', 0)
+        .arg(viewport.tileHits()).arg(viewport.tileMisses()).arg(viewport.cachedBytes() / (1024.0 * 1024.0), 0, 'f', 1), 3000);
+}
+void ImageCraft::zoomToFit() {
+    zoomViewport(0, QPoint());
+}
+void ImageCraft::zoomToActualSize() {   // one image pixel per screen pixel, about the middle of the view
+    QRect contents = ui.uploaded_pic->contentsRect();
+    zoomViewport(1.0 / viewport.scale(viewportSize()), contents.center());
+}
+
+void ImageCraft::discardPendingEdit() {
+    pending_edit = false;
+    render_worker.cancel();     // an in-flight preview must not replace what is displayed next
+}
+
+void ImageCraft::commitPendingEdit() {     // render the previewed slider edit at full resolution
+    if (!pending_edit) {
+        render_worker.cancel();
+        return;
+    }
+    Edit_Op op = pending_op;
+    discardPendingEdit();
+
+    if (preview_node >= 0) {
+        edit_graph.update(preview_node, op);
+    }
+    else {
+        preview_node = edit_graph.append(op);   // further slider moves change the node just added
+    }
+    universal_image = edit_graph.render();     // only the edited node and the ones after it are rendered again
+    undo_history.record(edit_graph.ops(0), universal_image);
+    enforceMemoryBudget();
+
+#ifndef NDEBUG
+    vector<Edit_Op> chain = edit_graph.ops(preview_node);
+    bool comparable = !preview_proxy.empty();
+    for (const Edit_Op& next : chain) {     // sharpening and geometry are not expected to survive downsampling
+        comparable = comparable && (next.kind == Edit_Kind::Brightness || next.kind == Edit_Kind::Contrast ||
+            (next.kind == Edit_Kind::Blur && next.value >= 0));
+    }
+    if (comparable) {
+        Mat proxy_image = preview_proxy;
+        for (const Edit_Op& next : chain) {
+            proxy_image = next.apply(proxy_image, preview_scale);
+        }
+        Mat downsampled, difference;
+        cv::resize(universal_image, downsampled, proxy_image.size(), 0, 0, INTER_AREA);
+        absdiff(downsampled, proxy_image, difference);
+        Scalar channel_error = mean(difference);
+        double error = (channel_error[0] + channel_error[1] + channel_error[2]) / 3.0;
+        if (error > preview_tolerance) {
+            cout << "Warning: preview differs from full resolution render by " << error << " levels." << endl;
+        }
+    }
+#endif
+}
+
+Slider_Precomputer::Render sliderRenderer() {   // the visible slider's edit and every edit after it on the proxy, at any value
+    Edit_Op op = pending_op;
+    vector<Edit_Op> tail = preview_node >= 0 ? edit_graph.ops(preview_node + 1) : vector<Edit_Op>();
+    Mat proxy = preview_proxy;
+    double scale = preview_scale;
+    Mip_Pyramid pyramid = resize_pyramid;   // shares the levels, the worker never sees them change
+    return [op, tail, proxy, scale, pyramid](int value, const function<bool()>& cancelled) {    // cancelled is empty for real ticks
+        Edit_Op at = op;
+        at.value = value;
+        auto step = [&](const Edit_Op& edit, const Mat& input) {
+            return cancelled ? edit.applyInBands(input, scale, cancelled) : edit.apply(input, scale);
+        };
+        Mat edited = at.kind == Edit_Kind::Resize && !pyramid.empty() ? pyramid.at(value / 100.0) : step(at, proxy);
+        for (const Edit_Op& next : tail) {
+            if (edited.empty()) {
+                break;
+            }
+            edited = step(next, edited);
+        }
+        return edited;
+    };
+}
+size_t sliderRenderKey() {      // changes whenever sliderRenderer() would render something else
+    Edit_Op op = pending_op;
+    op.value = 0;
+    size_t key = Edit_Op::combine(op.hash(), reinterpret_cast<size_t>(preview_proxy.data));
+    key = Edit_Op::combine(key, static_cast<size_t>(preview_proxy.cols) << 32 | static_cast<size_t>(preview_proxy.rows));
+    if (preview_node >= 0) {
+        for (const Edit_Op& next : edit_graph.ops(preview_node + 1)) {
+            key = Edit_Op::combine(key, next.hash());
+        }
+    }
+    return key;
+}
+
+void ImageCraft::beginSliderEdit(Edit_Kind kind, QAbstractSlider* slider) {   // the slider changes the existing edit of its kind or adds one
+    commitPendingEdit();
+    hideSliders();
+    slider->setVisible(true);
+
+    preview_node = edit_graph.find(kind);
+    Mat input = preview_node >= 0 ? edit_graph.renderBefore(preview_node) : universal_image;
+    Image_Operations imageOps;
+    preview_proxy = imageOps.previewProxy(input, ui.uploaded_pic->width(), ui.uploaded_pic->height(), preview_scale);
+    if (kind == Edit_Kind::Resize) {
+        resize_pyramid.build(preview_proxy);   // built once, every slider position is then a small resize of one level
+    }
+
+    pending_op = preview_node >= 0 ? edit_graph.op(preview_node) : Edit_Op();
+    pending_op.kind = kind;
+    if (preview_node >= 0 || kind != Edit_Kind::Resize) {
+        slider->blockSignals(true);     // moving the slider to the edit's value is not an edit
+        slider->setValue(pending_op.value);
+        slider->blockSignals(false);
+    }
+    if (kind == Edit_Kind::Brightness || kind == Edit_Kind::Contrast || kind == Edit_Kind::Blur) {
+        slider_precomputer.follow(sliderRenderKey(), sliderRenderer(), slider->value(), slider->minimum(), slider->maximum(),
+            Size(current_image_width, current_image_height));   // the user is about to drag, start around where the slider rests
+    }
+}
+
+void ImageCraft::previewSliderEdit(int value) {     // renders the edit and every edit after it on the proxy
+    if (preview_proxy.empty()) {
+        return;
+    }
+    pending_op.value = value;
+    pending_edit = true;    // full resolution is rendered on commit
+
+    Slider_Precomputer::Render render = sliderRenderer();
+    if (pending_op.kind == Edit_Kind::Brightness || pending_op.kind == Edit_Kind::Contrast || pending_op.kind == Edit_Kind::Blur) {
+        int64 input_tick = IMAGECRAFT_INPUT_TICK();
+        size_t key = sliderRenderKey();
+        QAbstractSlider* slider = pending_op.kind == Edit_Kind::Brightness ? ui.Brightness_Slider : (pending_op.kind == Edit_Kind::Contrast ? ui.Contrast_Slider : ui.Blur_Slider);
+        QImage frame;
+        bool hit = slider_precomputer.take(key, value, frame);
+        if (hit) {
+            render_worker.cancel();     // an older tick still rendering must not replace this frame
+            ui.uploaded_pic->setPixmap(QPixmap::fromImage(frame));
+            IMAGECRAFT_DISPLAYED(input_tick, ui.statusBar);
+        }
+        else {
+            renderPreview([render, value]() { return render(value, nullptr); });
+        }
+        slider_precomputer.follow(key, render, value, slider->minimum(), slider->maximum(), Size(current_image_width, current_image_height));
+        ui.statusBar->showMessage(tr("Slider ticks precomputed: %1% (%2 of %3), %4 frames cached").arg(slider_precomputer.hitRate() * 100, 0, 'f', 0)
+            .arg(slider_precomputer.hits()).arg(slider_precomputer.hits() + slider_precomputer.misses()).arg(slider_precomputer.cachedFrames()), 2000);
+        return;
+    }
+    renderPreview([render, value]() { return render(value, nullptr); });
+}
+
+void ImageCraft::appendEdit(const Edit_Op& op) {    // render a new edit on top of the cached chain and display it
+    int64 input_tick = IMAGECRAFT_INPUT_TICK();
+    commitPendingEdit();
+    Size before = universal_image.size();
+    bool geometric = op.kind == Edit_Kind::Rotate || op.kind == Edit_Kind::Flip || op.kind == Edit_Kind::Crop;
+    int last = edit_graph.size() - 1;
+    bool merge = geometric && last >= 0 && edit_graph.op(last).kind == Edit_Kind::Transform;
+    Edit_Op previous = merge ? edit_graph.op(last) : Edit_Op();
+    if (merge) {
+        edit_graph.update(last, previous.then(op));     // rotations, flips and crops in a row move pixels once
+    }
+    else if (geometric) {
+        edit_graph.append(Edit_Op::transform(before).then(op));
+    }
+    else {
+        edit_graph.append(op);
+    }
+    try {
+        universal_image = edit_graph.render();
+    }
+    catch (const std::exception&) {
+        if (merge) {
+            edit_graph.update(last, previous);
+        }
+        else {
+            edit_graph.remove(edit_graph.size() - 1);
+        }
+        throw;
+    }
+    if (op.kind == Edit_Kind::Crop) {
+        undo_history.recordCrop(edit_graph.ops(0), op.region & Rect(0, 0, before.width, before.height));
+    }
+    else {
+        undo_history.record(edit_graph.ops(0), universal_image);
+    }
+    enforceMemoryBudget();
+    showImage(universal_image);
+    IMAGECRAFT_DISPLAYED(input_tick, ui.statusBar);
 }
-ImageCraft::~ImageCraft() {}
 
 void ImageCraft::on_Import_Image_clicked() {
     QString path = QFileDialog::getOpenFileName(this, tr("Open Image"), ".", tr("Image Files (*.png *.jpg *.jpeg *.bmp)"));     // open file dialog to select image file
 
     if (!path.isEmpty()) {
-        Imag1.loadImage(path.toStdString());    // load image using Imag1 object
+        int64 start = getTickCount();
+        original_path = path.toStdString();
+        int generation = ++import_generation;   // the previous full decode may still run or be queued, it is dropped on delivery
+        discardPendingEdit();       // a preview of the previous image must never be committed
+        hideSliders();
+        viewport.fit();
+        // fit the qlabel while maintaining the aspect ratio, and keep the dimensions for later use
+        current_image_width = ui.uploaded_pic->width();
+        current_image_height = ui.uploaded_pic->height();
 
-        if (Imag1.isImageLoaded()) {
+        int reduction = 1;
+        Mat preview = Imag1.loadPreview(path.toStdString(), current_image_width, current_image_height, reduction);
+        if (!preview.empty()) {
+            Imag1.clear();          // edits wait for the full resolution image
+            showImage(preview);
+            double first_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            ui.statusBar->showMessage(tr("First image after %1 ms (1/%2 scale), loading full resolution...").arg(first_ms, 0, 'f', 0).arg(reduction));
+            string file = path.toStdString();
+            import_decoders.start([this, file, start, first_ms, generation]() {
+                Mat full;
+                {
+                    IMAGECRAFT_TRACE("decode");
+                    full = imread(file);
+                }
+                QMetaObject::invokeMethod(this, [this, full, start, first_ms, generation]() {
+                    if (generation != import_generation) {
+                        return;     // another image was imported meanwhile, or the window is closing
+                    }
+                    if (full.empty()) {
+                        QMessageBox::warning(this, tr("Error"), tr("Failed to load the selected image."));
+                        return;
+                    }
+                    Imag1.setImageData(full);
+                    setLoadedImage(full);
+                    double full_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+                    ui.statusBar->showMessage(tr("First image after %1 ms, full resolution after %2 ms").arg(first_ms, 0, 'f', 0).arg(full_ms, 0, 'f', 0), 5000);
+                }, Qt::QueuedConnection);
+            });
             QMessageBox::information(this, tr("Success"), tr("Image uploaded successfully!")); // Show a message box to the user
+            return;
+        }
 
-            Mat imageData = Imag1.getImageData();   // Access the loaded image data
-            universal_image = imageData;            // store as global variable for further operations
-            original_image = imageData.clone();
-            cout << "Image dimensions: " << imageData.rows << "x" << imageData.cols << endl;
-
-            // Convert Mat to QImage
-            QImage qImage(imageData.data, imageData.cols, imageData.rows, imageData.step, QImage::Format_BGR888);
-
-            // create a Qpixmap from QImage for displaying in the label
-            QPixmap pixmap = QPixmap::fromImage(qImage);
-
-            // resize pixmap to fit the qlabel while maintaining the aspect ratio
-            int width = ui.uploaded_pic->width();
-            int height = ui.uploaded_pic->height();
-            ui.uploaded_pic->setPixmap(pixmap.scaled(width, height, Qt::KeepAspectRatio));
+        Imag1.loadImage(path.toStdString());    // load image using Imag1 object
 
-            // update dimensions for later use
-            current_image_width = width;
-            current_image_height = height;
+        if (Imag1.isImageLoaded()) {
+            setLoadedImage(Imag1.getImageData());   // Access the loaded image data
+            double first_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            ui.statusBar->showMessage(tr("First image after %1 ms").arg(first_ms, 0, 'f', 0), 5000);
+            QMessageBox::information(this, tr("Success"), tr("Image uploaded successfully!")); // Show a message box to the user
         }
         else {
             QMessageBox::warning(this, tr("Error"), tr("Failed to load the selected image."));
@@ -288,12 +4655,34 @@ void ImageCraft::on_Import_Image_clicked() {
         cout << "No file selected." << endl;
     }
 }
+void ImageCraft::setLoadedImage(const Mat& imageData) {    // starts editing a newly decoded image
+    discardPendingEdit();
+    hideSliders();
+    original_image = imageData;             // edits never write into their input, no copy needed
+    edit_graph.setSource(original_image);
+    universal_image = imageData;            // store as global variable for further operations
+    undo_history.clear();
+    undo_history.record(edit_graph.ops(0), universal_image);
+    enforceMemoryBudget();
+    cout << "Image dimensions: " << imageData.rows << "x" << imageData.cols << endl;
+    showImage(imageData);
+}
 void ImageCraft::on_Export_Image_clicked() {
     if (Imag1.isImageLoaded()) {
         QString path = QFileDialog::getSaveFileName(this, tr("Save Image"), ".", tr("Image Files (*.png *.jpg *.jpeg *.bmp)"));     // open file dialog to select a save location and file name
         if (!path.isEmpty()) {
             try {
-                imwrite(path.toStdString(), universal_image);   // save the current processed image to specified path
+                commitPendingEdit();    // export always writes the full resolution render
+                int64 start = getTickCount();
+                string reason;
+                bool lossless = exportLossless(path.toStdString(), reason);
+                if (!lossless) {
+                    IMAGECRAFT_TRACE("encode");
+                    imwrite(path.toStdString(), universal_image);   // save the current processed image to specified path
+                }
+                double ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+                ui.statusBar->showMessage(lossless ? tr("Exported losslessly in %1 ms").arg(ms, 0, 'f', 0)
+                    : tr("Exported in %1 ms, re-encoded because %2").arg(ms, 0, 'f', 0).arg(QString::fromStdString(reason)), 5000);
                 QMessageBox::information(this, tr("Success"), tr("Image exported successfully!"));
             }
             catch (const std::exception& e) {
@@ -313,9 +4702,7 @@ void ImageCraft::on_Export_Image_clicked() {
 
 void ImageCraft::on_Resize_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        hideSliders();
-        ui.Resize_Slider->setVisible(true);
-        universal_image_for_resize = universal_image;
+        beginSliderEdit(Edit_Kind::Resize, ui.Resize_Slider);
     }
     else {
         QMessageBox::warning(this, tr("Error"),
@@ -323,13 +4710,11 @@ void ImageCraft::on_Resize_Button_clicked() {
     }
 }
 void ImageCraft::on_Resize_Slider_valueChanged(int value) {
-    Image_Operations imageOps;
-    Mat resizedImg = imageOps.resizeImage(universal_image_for_resize, value);   // resize universal image based on slider value
-
-    cout << "Error: Could not open the file." << endl;
+    if (preview_proxy.empty() || value < 1) {
+        return;
+    }
     float val = value / 100.0;  // scale factor based on slider value
 
-    QImage img_edited((const uchar*)resizedImg.data, resizedImg.cols, resizedImg.rows, resizedImg.step, QImage::Format_BGR888);
     // calculate new dimensions for QLabel based on scale factor
     int labelw = ui.uploaded_pic->width() * val;
     int labelh = ui.uploaded_pic->height() * val;
@@ -337,14 +4722,12 @@ void ImageCraft::on_Resize_Slider_valueChanged(int value) {
     current_image_width = labelw;
     current_image_height = labelh;
 
-    // display resized image in qlabel, scaling to fit updated dimension
-    ui.uploaded_pic->setPixmap(QPixmap::fromImage(img_edited).scaled(labelw, labelh));
-    universal_image = resizedImg;
+    // the proxy holds more pixels than the label can show, the full resize happens on commit
+    previewSliderEdit(value);
 }
 
 void ImageCraft::on_Rotate_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        cout << "Brightness button clicked. Showing brightness slider." << endl;
         hideSliders();
         ui.rotatecw->setVisible(true);
         ui.rotateacw->setVisible(true);
@@ -355,12 +4738,10 @@ void ImageCraft::on_Rotate_Button_clicked() {
 }
 void ImageCraft::on_rotatecw_clicked() {
     try {
-        Image_Operations imageops;
-        Mat rotated_image;
-        rotated_image = imageops.rotateimage(universal_image, 1);       //clockwise rotation
-        QImage rotatedQImage((const uchar*)rotated_image.data, rotated_image.cols, rotated_image.rows, rotated_image.step, QImage::Format_BGR888);
-        universal_image = rotated_image;
-        ui.uploaded_pic->setPixmap(QPixmap::fromImage(rotatedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+        Edit_Op rotation;
+        rotation.kind = Edit_Kind::Rotate;
+        rotation.value = 1;     //clockwise rotation
+        appendEdit(rotation);
     }
     catch (const std::exception& e) {
         QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -368,12 +4749,10 @@ void ImageCraft::on_rotatecw_clicked() {
 }
 void ImageCraft::on_rotateacw_clicked() {
     try {
-        Image_Operations imageops;
-        Mat rotated_image;
-        rotated_image = imageops.rotateimage(universal_image, -1);      // anticlockwise rotation
-        QImage rotatedQImage((const uchar*)rotated_image.data, rotated_image.cols, rotated_image.rows, rotated_image.step, QImage::Format_BGR888);
-        universal_image = rotated_image;
-        ui.uploaded_pic->setPixmap(QPixmap::fromImage(rotatedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+        Edit_Op rotation;
+        rotation.kind = Edit_Kind::Rotate;
+        rotation.value = -1;     // anticlockwise rotation
+        appendEdit(rotation);
     }
     catch (const std::exception& e) {
         QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -382,7 +4761,6 @@ void ImageCraft::on_rotateacw_clicked() {
 
 void ImageCraft::on_Flip_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        cout << "Brightness button clicked. Showing brightness slider." << endl;
         hideSliders();
         ui.vertflip->setVisible(true);
         ui.horiflip->setVisible(true);
@@ -393,12 +4771,10 @@ void ImageCraft::on_Flip_Button_clicked() {
 }
 void ImageCraft::on_vertflip_clicked() {
     try {
-        Image_Operations imageops;
-        Mat flipped_image;
-        flipped_image = imageops.flipimage(universal_image, 1);
-        QImage flippedQImage((const uchar*)flipped_image.data, flipped_image.cols, flipped_image.rows, flipped_image.step, QImage::Format_BGR888);
-        universal_image = flipped_image;
-        ui.uploaded_pic->setPixmap(QPixmap::fromImage(flippedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+        Edit_Op flip;
+        flip.kind = Edit_Kind::Flip;
+        flip.value = 1;
+        appendEdit(flip);
     }
     catch (const std::exception& e) {
         QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -406,13 +4782,10 @@ void ImageCraft::on_vertflip_clicked() {
 }
 void ImageCraft::on_horiflip_clicked() {
     try {
-        Image_Operations imageops;
-        Mat flipped_image;
-        flipped_image = imageops.flipimage(universal_image, -1);
-        QImage flippedQImage((const uchar*)flipped_image.data, flipped_image.cols, flipped_image.rows, flipped_image.step, QImage::Format_BGR888);
-        universal_image = flipped_image;
-        ui.uploaded_pic->setPixmap(
-            QPixmap::fromImage(flippedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+        Edit_Op flip;
+        flip.kind = Edit_Kind::Flip;
+        flip.value = -1;
+        appendEdit(flip);
     }
     catch (const std::exception& e) {
         QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -420,33 +4793,35 @@ void ImageCraft::on_horiflip_clicked() {
 }
 
 void ImageCraft::on_Crop_Button_clicked() {
-    universal_image_for_crop = universal_image;
+    commitPendingEdit();
 
     if (selectionRect.isNull()) {
         QMessageBox::warning(this, tr("Error"), tr("No crop area selected."));
         return;
     }
 
-    // map selectionRect to the actual image coordinates
-    double xScale = static_cast<double>(universal_image.cols) / ui.uploaded_pic->width();
-    double yScale = static_cast<double>(universal_image.rows) / ui.uploaded_pic->height();
-
-    int x = static_cast<int>(selectionRect.x() * xScale);
-    int y = static_cast<int>(selectionRect.y() * yScale);
-    int width = static_cast<int>(selectionRect.width() * xScale);
-    int height = static_cast<int>(selectionRect.height() * yScale);
+    // map selectionRect to the actual image coordinates through the fitted frame or the zoomed view
+    Point2d top_left = viewport.toImage(viewportOffset(selectionRect.topLeft()), viewportSize());
+    Point2d bottom_right = viewport.toImage(viewportOffset(selectionRect.bottomRight() + QPoint(1, 1)), viewportSize());
+    Rect region = Rect(Point(cvRound(top_left.x), cvRound(top_left.y)), Point(cvRound(bottom_right.x), cvRound(bottom_right.y)))
+        & Rect(0, 0, universal_image.cols, universal_image.rows);     // the part of the selection over the image
 
     // Ensure valid crop area
-    if (x < 0 || y < 0 || x + width > universal_image.cols || y + height > universal_image.rows) {
+    if (region.empty()) {
         QMessageBox::warning(this, tr("Error"), tr("Invalid crop area. Please try again."));
         return;
     }
 
-    Mat croppedImage = universal_image_for_crop(Rect(x, y, width, height)); // Crop the image 
-
-    QImage croppedQImage((const uchar*)croppedImage.data, croppedImage.cols, croppedImage.rows, croppedImage.step, QImage::Format_BGR888);
-    ui.uploaded_pic->setPixmap(QPixmap::fromImage(croppedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
-    universal_image = croppedImage;
+    Edit_Op crop;
+    crop.kind = Edit_Kind::Crop;
+    crop.region = region;
+    try {
+        appendEdit(crop);   // Crop the image
+    }
+    catch (const std::exception& e) {
+        QMessageBox::warning(this, tr("Error"), tr(e.what()));
+        return;
+    }
     QMessageBox::information(this, tr("Success"), tr("Image cropped successfully!"));
     //current_image_width = croppedImage.cols;
     //current_image_height = croppedImage.rows;
@@ -454,7 +4829,7 @@ void ImageCraft::on_Crop_Button_clicked() {
     current_image_width = ui.uploaded_pic->width();
 
     selectionRect = QRect(); // Reset the selection rectangle
-    update();
+    overlay_layer->setSelection(selectionRect);
 }
 
 void ImageCraft::on_AddText_Button_clicked() {
@@ -474,37 +4849,32 @@ void ImageCraft::on_AddText_Button_clicked() {
         }
         QStringList items;
         items << tr("Top-Left") << tr("Top-Right") << tr("Bottom-Left") << tr("Bottom-Right") << tr("Center");
+        Edit_Op guide;
+        guide.text = text.toStdString();
+        guide.font_size = font.pointSize();
+        vector<QRect> guides;   // outline of the text at every position while one is chosen
+        for (const QString& item : items) {
+            guide.position = item.toStdString();
+            guides.push_back(labelRect(guide.textBounds(universal_image.size())));
+        }
+        overlay_layer->setGuides(guides);
         QString position = QInputDialog::getItem(this, tr("Text Position"), tr("Select the position:"), items, 0, false, &ok);
+        overlay_layer->setGuides(vector<QRect>());
         if (!ok || position.isEmpty()) {
             return;
         }
-
-        int fontFace = FONT_HERSHEY_SIMPLEX;    // Convert QFont to cv::HersheyFonts equivalent
-        int thickness = 4;
-        int baseline = 0;
-        int fontSize = font.pointSize();
-        cv::Size textSize = cv::getTextSize(text.toStdString(), fontFace, fontSize / 10.0, thickness, &baseline);
-
-        cv::Point textOrg;
-        if (position == "Top-Left") {
-            textOrg = cv::Point(10, textSize.height + 10);
-        }
-        else if (position == "Top-Right") {
-            textOrg = cv::Point(universal_image.cols - textSize.width - 10, textSize.height + 10);
-        }
-        else if (position == "Bottom-Left") {
-            textOrg = cv::Point(10, universal_image.rows - 10);
-        }
-        else if (position == "Bottom-Right") {
-            textOrg = cv::Point(universal_image.cols - textSize.width - 10, universal_image.rows - 10);
+        Edit_Op overlay;
+        overlay.kind = Edit_Kind::Text;
+        overlay.text = text.toStdString();
+        overlay.position = position.toStdString();
+        overlay.font_size = font.pointSize();
+        overlay.color = Scalar(color.blue(), color.green(), color.red()); // Convert QColor to cv::Scalar
+        try {
+            appendEdit(overlay);    // Add text on top of the current edits
         }
-        else if (position == "Center") {
-            textOrg = cv::Point((universal_image.cols - textSize.width) / 2, (universal_image.rows + textSize.height) / 2);
+        catch (const std::exception& e) {
+            QMessageBox::warning(this, tr("Error"), tr(e.what()));
         }
-        Scalar fontColor(color.blue(), color.green(), color.red()); // Convert QColor to cv::Scalar
-        putText(universal_image, text.toStdString(), textOrg, fontFace, fontSize / 10.0, fontColor, thickness); // Add text to the original image
-        QImage updatedQImage = MatToQImage(universal_image);
-        ui.uploaded_pic->setPixmap(QPixmap::fromImage(updatedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
     }
     else {
         QMessageBox::warning(this, tr("Error"), tr("No image loaded. Please upload an image first."));
@@ -514,118 +4884,56 @@ void ImageCraft::on_AddText_Button_clicked() {
 
 void ImageCraft::on_Brightness_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        cout << "Brightness button clicked. Showing brightness slider." << endl;
-        hideSliders();
-        ui.Brightness_Slider->setVisible(true);
-        universal_image_for_brightness = universal_image;
+        beginSliderEdit(Edit_Kind::Brightness, ui.Brightness_Slider);
     }
     else {
         QMessageBox::warning(this, tr("Error"), tr("No image loaded. Please upload an image first."));
     }
 }
 void ImageCraft::on_Brightness_Slider_valueChanged(int value) {
-    try {
-        Image_Filters obj1;
-        Mat bright_image;
-        bright_image = obj1.brightness_adjustment(universal_image_for_brightness, value); // Adjust brightness using the slider value
-
-        QImage brightenedQImage((const uchar*)bright_image.data, bright_image.cols,
-            bright_image.rows, bright_image.step, QImage::Format_BGR888);
-
-        universal_image = bright_image;
-        ui.uploaded_pic->setPixmap(
-            QPixmap::fromImage(brightenedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
-    }
-    catch (const std::exception& e) {
-        QMessageBox::warning(this, tr("Error"), tr(e.what()));
-    }
-
+    previewSliderEdit(value);   // adjust the preview using the slider value
 }
 
 void ImageCraft::on_Contrast_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        hideSliders();
-        ui.Contrast_Slider->setVisible(true);
-        universal_image_for_contrast = universal_image;
+        beginSliderEdit(Edit_Kind::Contrast, ui.Contrast_Slider);
     }
     else {
         QMessageBox::warning(this, tr("Error"), tr("No image loaded. Please upload an image first."));
     }
 }
 void ImageCraft::on_Contrast_Slider_valueChanged(int value) {
-    try {
-        Image_Filters obj2;
-        Mat contrast_image;
-
-        contrast_image = obj2.contrast_adjustment(universal_image_for_contrast, value); // adjust contrast using slider value
-        QImage contrastedQImage((const uchar*)contrast_image.data, contrast_image.cols, contrast_image.rows, contrast_image.step, QImage::Format_BGR888);
-
-        universal_image = contrast_image;
-        ui.uploaded_pic->setPixmap(QPixmap::fromImage(contrastedQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
-    }
-    catch (const std::exception& e) {
-        QMessageBox::warning(this, tr("Error"), tr(e.what()));
-    }
+    previewSliderEdit(value);   // adjust the preview using the slider value
 }
 
 void ImageCraft::on_Blur_Button_clicked() {
     if (Imag1.isImageLoaded()) {
-        cout << "Brightness button clicked. Showing brightness slider." << endl;
-        hideSliders();
-        ui.Blur_Slider->setVisible(true);
-        universal_image_for_blur = universal_image;
+        beginSliderEdit(Edit_Kind::Blur, ui.Blur_Slider);
     }
     else {
         QMessageBox::warning(this, tr("Error"), tr("No image loaded. Please upload an image first."));
     }
 }
 void ImageCraft::on_Blur_Slider_valueChanged(int value) {
-    try {
-        Image_Filters obj1;
-        Mat blur_image;
-        blur_image = obj1.blur_adjustment(universal_image_for_blur, value); // adjust blurness using slider value
-
-        QImage blurredQImage((const uchar*)blur_image.data, blur_image.cols, blur_image.rows, blur_image.step, QImage::Format_BGR888);
-
-        universal_image = blur_image;
-        ui.uploaded_pic->setPixmap(
-            QPixmap::fromImage(blurredQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
-    }
-    catch (const std::exception& e) {
-        QMessageBox::warning(this, tr("Error"), tr(e.what()));
-    }
-
+    previewSliderEdit(value);   // adjust the preview using the slider value
 }
 
 
 void ImageCraft::on_Filter_ComboBox_currentIndexChanged(int index) {
     if (Imag1.isImageLoaded()) {
+        commitPendingEdit();
         hideSliders();
-        Image_Filters filters;
-        Mat filtered_image = original_image.clone();
 
         try {
-            if (index == 0) {
-                filtered_image = original_image.clone();
-            }
-            else if (index == 1) { // Grayscale
-                filtered_image = filters.gray_filter(filtered_image);
-                cvtColor(filtered_image, filtered_image, COLOR_GRAY2BGR);
-            }
-            else if (index == 2) { // Sepia
-                filtered_image = filters.sepia_filter(filtered_image);
-            }
-            else if (index == 3) { // Inversion
-                filtered_image = filters.color_inversion(filtered_image);
-            }
+            Edit_Op filter;
+            filter.kind = Edit_Kind::Filter;
+            filter.value = index;   // 1 Grayscale, 2 Sepia, 3 Inversion
+            replaceEdit(filter, index != 0);
 
-            if (filtered_image.empty()) {
+            if (universal_image.empty()) {
                 throw std::runtime_error("Filtered image is empty.");
             }
-            universal_image = filtered_image.clone();      // Update universal_image and display the filtered image
-
-            QImage filteredQImage = MatToQImage(filtered_image);
-            ui.uploaded_pic->setPixmap(QPixmap::fromImage(filteredQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+            showImage(universal_image);
         }
         catch (const std::exception& e) {
             QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -637,29 +4945,16 @@ void ImageCraft::on_Filter_ComboBox_currentIndexChanged(int index) {
 }
 void ImageCraft::on_Color_ComboBox_currentIndexChanged(int index) {
     if (Imag1.isImageLoaded()) {
+        commitPendingEdit();
         hideSliders();
-        Image_Filters filters;
-        Mat filtered_image = universal_image.clone();
 
         try {
-            if (index == 0) {
-                filtered_image = original_image.clone(); // Reset to original image
-            }
-            else if (index == 1) { // Red
-                filtered_image = filters.color_isolation(filtered_image, 0);
-            }
-            else if (index == 2) { // Green
-                filtered_image = filters.color_isolation(filtered_image, 1);
-            }
-            else if (index == 3) { // Blue
-                filtered_image = filters.color_isolation(filtered_image, 2);
-            }
-            else if (index == 4) {
-                filtered_image = filters.color_isolation(filtered_image, 3);
-            }
-            universal_image = filtered_image;   // Update universal_image and display the filtered image
-            QImage filteredQImage = MatToQImage(filtered_image);
-            ui.uploaded_pic->setPixmap(QPixmap::fromImage(filteredQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+            Edit_Op isolation;
+            isolation.kind = Edit_Kind::Color_Isolation;
+            isolation.value = index - 1;    // 0 Red, 1 Green, 2 Blue, 3 Yellow
+            replaceEdit(isolation, index != 0);
+
+            showImage(universal_image);
         }
         catch (const std::exception& e) {
             QMessageBox::warning(this, tr("Error"), tr(e.what()));
@@ -670,15 +4965,106 @@ void ImageCraft::on_Color_ComboBox_currentIndexChanged(int index) {
     }
 }
 
+void ImageCraft::replaceEdit(const Edit_Op& op, bool enabled) {    // changes the existing edit of this kind in place, earlier and later edits are kept
+    int node = edit_graph.find(op.kind);
+    if (!enabled) {
+        if (node >= 0) {
+            edit_graph.remove(node);
+        }
+    }
+    else if (node >= 0) {
+        edit_graph.update(node, op);
+    }
+    else {
+        edit_graph.append(op);
+    }
+    universal_image = edit_graph.render();
+    undo_history.record(edit_graph.ops(0), universal_image);
+    enforceMemoryBudget();
+}
+
+void ImageCraft::undoEdit() {
+    discardPendingEdit();       // an unfinished slider preview is simply dropped
+    hideSliders();
+    if (undo_history.canUndo()) {
+        showHistoryState(undo_history.undo());
+    }
+}
+void ImageCraft::redoEdit() {
+    discardPendingEdit();
+    hideSliders();
+    if (undo_history.canRedo()) {
+        showHistoryState(undo_history.redo());
+    }
+}
+void ImageCraft::showHistoryState(const vector<Edit_Op>& ops) {    // swaps edit lists, pixels come from cache or history tiles
+    try {
+        edit_graph.restore(ops);
+        if (!edit_graph.cached()) {
+            edit_graph.seed(undo_history.image());  // one copy of the stored tiles, never a re-render
+        }
+        universal_image = edit_graph.render();
+        enforceMemoryBudget();
+        showImage(universal_image);
+        Frame_Pool& frame_pool = Frame_Pool::instance();
+        double mb = 1024.0 * 1024.0;
+        ui.statusBar->showMessage(tr("Images: %1 of %2 MB, %3 MB spilled, undo history: %4 MB, frame pool: %5 hits, %6 misses, %7 MB cached")
+            .arg(memory_budget.resident() / mb, 0, 'f', 1).arg(memory_budget.ceiling() / mb, 0, 'f', 0).arg(memory_budget.spilled() / mb, 0, 'f', 1)
+            .arg(undo_history.bytes() / mb, 0, 'f', 1).arg(frame_pool.hits()).arg(frame_pool.misses()).arg(frame_pool.cachedBytes() / mb, 0, 'f', 1), 3000);
+    }
+    catch (const std::exception& e) {
+        QMessageBox::warning(this, tr("Error"), tr(e.what()));
+    }
+}
+
+void ImageCraft::saveRecipe() {     // the current edit list, replayable with --recipe or --batch @file
+    commitPendingEdit();
+    QString path = QFileDialog::getSaveFileName(this, tr("Save Recipe"), ".", tr("Recipes (*.recipe *.txt)"));
+    if (path.isEmpty()) {
+        return;
+    }
+    try {
+        Recipe::save(path.toStdString(), edit_graph.ops(0));
+    }
+    catch (const std::exception& e) {
+        QMessageBox::warning(this, tr("Error"), tr(e.what()));
+    }
+}
+void ImageCraft::loadRecipe() {     // replaces the edit list, the recipe runs as written so every edit stays adjustable
+    if (!Imag1.isImageLoaded()) {
+        QMessageBox::warning(this, tr("Error"), tr("No image loaded. Please upload an image first."));
+        return;
+    }
+    QString path = QFileDialog::getOpenFileName(this, tr("Open Recipe"), ".", tr("Recipes (*.recipe *.txt)"));
+    if (path.isEmpty()) {
+        return;
+    }
+    try {
+        vector<Edit_Op> ops = Recipe::load(path.toStdString());
+        discardPendingEdit();
+        hideSliders();
+        edit_graph.restore(ops);
+        universal_image = edit_graph.render();
+        undo_history.record(edit_graph.ops(0), universal_image);    // loading a recipe can be undone
+        enforceMemoryBudget();
+        showImage(universal_image);
+    }
+    catch (const std::exception& e) {
+        QMessageBox::warning(this, tr("Error"), tr(e.what()));
+    }
+}
 
 void ImageCraft::on_Reset_Button_clicked() {
     if (Imag1.isImageLoaded()) {
         QMessageBox::StandardButton reply;
         reply = QMessageBox::question(this, tr("Reset Image"), tr("This will clear all presets. Do you want to proceed?"), QMessageBox::Yes | QMessageBox::No);
         if (reply == QMessageBox::Yes) {
-            universal_image = original_image.clone();
-            QImage originalQImage = MatToQImage(original_image);
-            ui.uploaded_pic->setPixmap(QPixmap::fromImage(originalQImage).scaled(current_image_width, current_image_height, Qt::KeepAspectRatio));
+            discardPendingEdit();
+            edit_graph.clear();
+            universal_image = edit_graph.render();
+            undo_history.record(edit_graph.ops(0), universal_image);    // a reset can be undone too
+            enforceMemoryBudget();
+            showImage(universal_image);
             hideSliders();
         }
     }
@@ -689,6 +5075,11 @@ void ImageCraft::on_Reset_Button_clicked() {
 
 
 void ImageCraft::mousePressEvent(QMouseEvent* event) {
+    if (event->button() != Qt::LeftButton && viewport.zoomed() && ui.uploaded_pic->geometry().contains(event->pos())) {
+        isPanning = true;
+        panPoint = event->pos();
+        return;
+    }
     // Start dragging if mouse click is within the QLabel area
     if (ui.uploaded_pic->geometry().contains(event->pos())) {
         isDragging = true;
@@ -697,32 +5088,43 @@ void ImageCraft::mousePressEvent(QMouseEvent* event) {
     }
 }
 void ImageCraft::mouseMoveEvent(QMouseEvent* event) {
+    if (isPanning) {    // only tiles scrolling into view are scaled, the rest come from the cache
+        QPoint moved = event->pos() - panPoint;
+        panPoint = event->pos();
+        viewport.pan(Point2d(moved.x(), moved.y()));
+        showViewport();
+        return;
+    }
     if (isDragging) {
         // Update the endPoint as the mouse moves
         endPoint = event->pos() - ui.uploaded_pic->geometry().topLeft();
         selectionRect = QRect(startPoint, endPoint).normalized(); // Ensure valid rectangle
-        update(); // Trigger repaint
+        overlay_layer->setSelection(selectionRect);   // repaints the old and new outline only
     }
 }
 void ImageCraft::mouseReleaseEvent(QMouseEvent* event) {
+    if (isPanning) {
+        isPanning = false;
+        return;
+    }
     if (isDragging) {
         isDragging = false;
         endPoint = event->pos() - ui.uploaded_pic->geometry().topLeft();
         selectionRect = QRect(startPoint, endPoint).normalized();
-        update(); // Final repaint
+        overlay_layer->setSelection(selectionRect);
     }
 }
-void ImageCraft::paintEvent(QPaintEvent* event) {
-    QWidget::paintEvent(event);
-    if (isDragging || !selectionRect.isNull()) {
-        QPainter painter(this);
-        painter.setPen(QPen(Qt::red, 2, Qt::DashLine));
-        painter.setBrush(QBrush(QColor(255, 0, 0, 50))); // Transparent red
-        painter.drawRect(selectionRect.translated(ui.uploaded_pic->geometry().topLeft()));
+void ImageCraft::wheelEvent(QWheelEvent* event) {    // zooms about the cursor
+    QPoint position = event->position().toPoint();
+    if (!ui.uploaded_pic->geometry().contains(position)) {
+        QMainWindow::wheelEvent(event);
+        return;
     }
+    zoomViewport(pow(1.25, event->angleDelta().y() / 120.0), position - ui.uploaded_pic->geometry().topLeft());
 }
 
 QImage ImageCraft::MatToQImage(const cv::Mat& mat) {
+    IMAGECRAFT_TRACE("ImageCraft::MatToQImage");
     if (mat.empty()) {
         throw std::runtime_error("Empty image provided.");
     }
@@ -730,14 +5132,10 @@ QImage ImageCraft::MatToQImage(const cv::Mat& mat) {
         return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_Grayscale8).copy();
     }
     else if (mat.type() == CV_8UC3) {
-        cv::Mat rgb;
-        cv::cvtColor(mat, rgb, cv::COLOR_BGR2RGB);
-        return QImage(rgb.data, rgb.cols, rgb.rows, rgb.step, QImage::Format_RGB888).copy();
+        return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_BGR888).copy();     // Mat byte order, no swizzle
     }
     else if (mat.type() == CV_8UC4) {
-        cv::Mat rgba;
-        cv::cvtColor(mat, rgba, cv::COLOR_BGRA2RGBA);
-        return QImage(rgba.data, rgba.cols, rgba.rows, rgba.step, QImage::Format_RGBA8888).copy();
+        return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_ARGB32).copy();     // BGRA in memory on little-endian
     }
     else {
         throw std::runtime_error("Unsupported image format.");
@@ -6,6 +6,18 @@
 #include <opencv2/core.hpp> // Include OpenCV core header
 #include <QMouseEvent>
 #include <QPainter>
+#include <functional>
+#include <vector>
+
+enum class Edit_Kind;
+struct Edit_Op;
+class QAbstractSlider;
+
+int runTiledCommand(int argc, char* argv[]);    // headless tiled processing for images larger than memory
+int runBenchmarkCommand(int argc, char* argv[]);    // micro-benchmarks of every filter and operation, JSON output
+int runBatchCommand(int argc, char* argv[]);    // headless edit chain over many files on a thread pool
+int runRecipeCommand(int argc, char* argv[]);   // plans and runs a saved recipe on one file
+int runVideoCommand(int argc, char* argv[]);    // edit chain over video or numbered frames, parallel but in order
 
 class ImageCraft : public QMainWindow
 {
@@ -15,9 +27,28 @@ public:
     ImageCraft(QWidget* parent = nullptr);
     ~ImageCraft();
 
+    static QImage MatToQImage(const cv::Mat& mat);
+
 private:
     Ui::ImageCraftClass ui;
 
+    void commitPendingEdit();
+    void discardPendingEdit();
+    void showImage(const cv::Mat& img);
+    void showViewport();
+    cv::Size viewportSize() const;
+    cv::Point2d viewportOffset(QPoint label_point) const;
+    QRect labelRect(const cv::Rect& image_rect) const;
+    void zoomViewport(double factor, QPoint label_point);
+    void setLoadedImage(const cv::Mat& imageData);
+    void renderPreview(std::function<cv::Mat()> render);
+    void beginSliderEdit(Edit_Kind kind, QAbstractSlider* slider);
+    void previewSliderEdit(int value);
+    void appendEdit(const Edit_Op& op);
+    void replaceEdit(const Edit_Op& op, bool enabled);
+    void showHistoryState(const std::vector<Edit_Op>& ops);
+    void enforceMemoryBudget();
+
 
 private slots:
     void on_Import_Image_clicked();
@@ -55,15 +86,19 @@ private slots:
 
 
     void on_Reset_Button_clicked();
+    void undoEdit();
+    void redoEdit();
+    void saveRecipe();
+    void loadRecipe();
+    void zoomToFit();
+    void zoomToActualSize();
 
 
     void hideSliders();
 
-    QImage MatToQImage(const cv::Mat& mat);
-
 protected:
     void mousePressEvent(QMouseEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
     void mouseReleaseEvent(QMouseEvent* event) override;
-    void paintEvent(QPaintEvent* event) override;
+    void wheelEvent(QWheelEvent* event) override;
 };
@@ -0,0 +1,224 @@
+// JpegLossless.h
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <jpeglib.h>        // link with libjpeg
+
+// Lossless JPEG geometry in the DCT domain, as jpegtran does it. Whole coefficient blocks are moved and
+// transposed, and mirroring negates the odd frequencies, so nothing is quantized again. A crop must start on
+// an iMCU boundary, and a mirrored axis must span whole iMCUs, otherwise a partial block would land inside
+// the output; those cases return false and the caller re-encodes pixels.
+class Jpeg_Lossless {
+public:
+    static bool transform(const std::string& input, const std::string& output, cv::Rect region, int orientation, std::string& reason) {
+        FILE* in = fopen(input.c_str(), "rb");
+        if (!in) {
+            reason = "cannot open " + input;
+            return false;
+        }
+        FILE* out = fopen((output + ".part").c_str(), "wb");    // the target is only replaced by a complete file
+        if (!out) {
+            fclose(in);
+            reason = "cannot write " + output;
+            return false;
+        }
+        char message[JMSG_LENGTH_MAX] = {};
+        bool written = run(in, out, region, orientation, message);
+        fclose(in);
+        fclose(out);
+        if (!written) {
+            remove((output + ".part").c_str());
+            reason = message;
+            return false;
+        }
+        remove(output.c_str());
+        if (rename((output + ".part").c_str(), output.c_str()) != 0) {
+            reason = "cannot write " + output;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Error_Manager {
+        jpeg_error_mgr manager;     // first member, libjpeg hands back a pointer to it
+        jmp_buf jump;
+        char* message;
+    };
+    static void errorExit(j_common_ptr info) {
+        Error_Manager* error = reinterpret_cast<Error_Manager*>(info->err);
+        (*info->err->format_message)(info, error->message);
+        longjmp(error->jump, 1);
+    }
+    static int roundUp(int value, int multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+    static int blocks(int pixels, int samp, int max_samp) {     // blocks of one component, padded to whole MCUs
+        return roundUp(roundUp(pixels * samp, max_samp * DCTSIZE) / (max_samp * DCTSIZE), samp);
+    }
+
+    // Only plain C data lives in this frame, so a libjpeg error can longjmp out of it safely.
+    static bool run(FILE* in, FILE* out, cv::Rect region, int orientation, char* message) {
+        jpeg_decompress_struct src;
+        jpeg_compress_struct dst;
+        Error_Manager error;    // shared, so a single setjmp catches errors of both objects
+        src.err = dst.err = jpeg_std_error(&error.manager);
+        error.manager.error_exit = errorExit;
+        error.message = message;
+        jpeg_create_decompress(&src);
+        jpeg_create_compress(&dst);
+        if (setjmp(error.jump)) {
+            jpeg_destroy_compress(&dst);
+            jpeg_destroy_decompress(&src);
+            return false;
+        }
+        jpeg_stdio_src(&src, in);
+        jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+        for (int m = 1; m < 16; m++) {
+            jpeg_save_markers(&src, JPEG_APP0 + m, 0xFFFF);
+        }
+        jpeg_read_header(&src, TRUE);
+
+        bool transposed = orientation & 1, mirror_x = orientation & 2, mirror_y = orientation & 4;
+        int mcu_width = src.max_h_samp_factor * DCTSIZE, mcu_height = src.max_v_samp_factor * DCTSIZE;
+        const char* refusal = nullptr;
+        if (exifOrientation(src) > 1) {
+            refusal = "the image is displayed through an EXIF orientation";
+        }
+        else if (region.x < 0 || region.y < 0 || region.x + region.width > static_cast<int>(src.image_width) || region.y + region.height > static_cast<int>(src.image_height)) {
+            refusal = "the region is outside the image";
+        }
+        else if (region.x % mcu_width || region.y % mcu_height) {
+            refusal = "the crop does not start on an iMCU boundary";
+        }
+        else if ((mirror_x && region.width % mcu_width) || (mirror_y && region.height % mcu_height)) {
+            refusal = "a mirrored edge is not iMCU aligned";
+        }
+        if (refusal) {
+            snprintf(message, JMSG_LENGTH_MAX, "%s", refusal);
+            jpeg_destroy_compress(&dst);
+            jpeg_destroy_decompress(&src);
+            return false;
+        }
+
+        int out_max_h = transposed ? src.max_v_samp_factor : src.max_h_samp_factor;
+        int out_max_v = transposed ? src.max_h_samp_factor : src.max_v_samp_factor;
+        int out_width = transposed ? region.height : region.width, out_height = transposed ? region.width : region.height;
+        jvirt_barray_ptr* dst_coefs = static_cast<jvirt_barray_ptr*>((*src.mem->alloc_small)(
+            reinterpret_cast<j_common_ptr>(&src), JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * src.num_components));
+        for (int ci = 0; ci < src.num_components; ci++) {     // requested before the read so they are realized with the source arrays
+            int h_samp = transposed ? src.comp_info[ci].v_samp_factor : src.comp_info[ci].h_samp_factor;
+            int v_samp = transposed ? src.comp_info[ci].h_samp_factor : src.comp_info[ci].v_samp_factor;
+            dst_coefs[ci] = (*src.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&src), JPOOL_IMAGE, FALSE,
+                blocks(out_width, h_samp, out_max_h), blocks(out_height, v_samp, out_max_v), v_samp);
+        }
+        jvirt_barray_ptr* src_coefs = jpeg_read_coefficients(&src);
+        jpeg_copy_critical_parameters(&src, &dst);
+        dst.image_width = out_width;
+        dst.image_height = out_height;
+        if (transposed) {
+            for (int ci = 0; ci < dst.num_components; ci++) {
+                std::swap(dst.comp_info[ci].h_samp_factor, dst.comp_info[ci].v_samp_factor);
+            }
+            for (int t = 0; t < NUM_QUANT_TBLS; t++) {  // quantization tables are not symmetric, they follow the coefficients
+                JQUANT_TBL* table = dst.quant_tbl_ptrs[t];
+                if (table) {
+                    for (int k = 0; k < DCTSIZE; k++) {
+                        for (int l = 0; l < k; l++) {
+                            std::swap(table->quantval[k * DCTSIZE + l], table->quantval[l * DCTSIZE + k]);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int ci = 0; ci < src.num_components; ci++) {
+            jpeg_component_info* in_comp = &src.comp_info[ci];
+            jpeg_component_info* out_comp = &dst.comp_info[ci];
+            int block_x0 = region.x / mcu_width * in_comp->h_samp_factor;   // region origin and size in this component's blocks
+            int block_y0 = region.y / mcu_height * in_comp->v_samp_factor;
+            int region_blocks_x = roundUp(region.width * in_comp->h_samp_factor, mcu_width) / mcu_width;
+            int region_blocks_y = roundUp(region.height * in_comp->v_samp_factor, mcu_height) / mcu_height;
+            int src_rows = roundUp(in_comp->height_in_blocks, in_comp->v_samp_factor);
+            int src_cols = roundUp(in_comp->width_in_blocks, in_comp->h_samp_factor);
+            int out_cols = blocks(out_width, out_comp->h_samp_factor, out_max_h);
+            int out_rows = blocks(out_height, out_comp->v_samp_factor, out_max_v);
+            for (int by = 0; by < out_rows; by += out_comp->v_samp_factor) {
+                JBLOCKARRAY dst_rows = (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), dst_coefs[ci], by, out_comp->v_samp_factor, TRUE);
+                for (int row = 0; row < out_comp->v_samp_factor; row++) {
+                    for (int bx = 0; bx < out_cols; bx++) {
+                        int u = transposed ? by + row : bx, v = transposed ? bx : by + row;
+                        int sx = block_x0 + (mirror_x ? region_blocks_x - 1 - u : u);
+                        int sy = block_y0 + (mirror_y ? region_blocks_y - 1 - v : v);
+                        JCOEFPTR target = dst_rows[row][bx];
+                        if (sx < 0 || sy < 0 || sx >= src_cols || sy >= src_rows) {
+                            memset(target, 0, sizeof(JBLOCK));      // padding past the image edge
+                            continue;
+                        }
+                        JBLOCKARRAY src_row = (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), src_coefs[ci], sy, 1, FALSE);
+                        orientBlock(src_row[0][sx], target, transposed, mirror_x, mirror_y);
+                    }
+                }
+            }
+        }
+
+        jpeg_stdio_dest(&dst, out);
+        jpeg_write_coefficients(&dst, dst_coefs);
+        for (jpeg_saved_marker_ptr marker = src.marker_list; marker; marker = marker->next) {
+            bool jfif = marker->marker == JPEG_APP0 && marker->data_length >= 5 && memcmp(marker->data, "JFIF", 5) == 0;
+            bool adobe = marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5 && memcmp(marker->data, "Adobe", 5) == 0;
+            if (!(jfif && dst.write_JFIF_header) && !(adobe && dst.write_Adobe_marker)) {     // libjpeg writes those itself
+                jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+            }
+        }
+        jpeg_finish_compress(&dst);
+        jpeg_finish_decompress(&src);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return true;
+    }
+
+    // Coefficients are in natural order, row k holds vertical frequency k. Transposing pixels transposes the
+    // coefficients, mirroring columns negates odd horizontal frequencies and mirroring rows odd vertical ones.
+    static void orientBlock(const JCOEF* in, JCOEF* out, bool transposed, bool mirror_x, bool mirror_y) {
+        for (int k = 0; k < DCTSIZE; k++) {
+            for (int l = 0; l < DCTSIZE; l++) {
+                JCOEF c = transposed ? in[l * DCTSIZE + k] : in[k * DCTSIZE + l];
+                bool negate = transposed ? ((mirror_x && (k & 1)) != (mirror_y && (l & 1))) : ((mirror_y && (k & 1)) != (mirror_x && (l & 1)));
+                out[k * DCTSIZE + l] = negate ? static_cast<JCOEF>(-c) : c;
+            }
+        }
+    }
+
+    static int exifOrientation(const jpeg_decompress_struct& info) {   // tag 0x0112 of IFD0, 1 when absent
+        for (jpeg_saved_marker_ptr marker = info.marker_list; marker; marker = marker->next) {
+            const JOCTET* data = marker->data;
+            unsigned int length = marker->data_length;
+            if (marker->marker != JPEG_APP0 + 1 || length < 14 || memcmp(data, "Exif\0\0", 6) != 0) {
+                continue;
+            }
+            const JOCTET* tiff = data + 6;
+            unsigned int size = length - 6;
+            bool little = tiff[0] == 'I';
+            auto read16 = [&](unsigned int at) { return little ? tiff[at] | (tiff[at + 1] << 8) : (tiff[at] << 8) | tiff[at + 1]; };
+            auto read32 = [&](unsigned int at) { return little ? read16(at) | (read16(at + 2) << 16) : (read16(at) << 16) | read16(at + 2); };
+            unsigned int ifd = static_cast<unsigned int>(read32(4));
+            if (ifd + 2 > size) {
+                return 1;
+            }
+            int entries = read16(ifd);
+            for (int i = 0; i < entries && ifd + 2 + 12 * (i + 1) <= size; i++) {
+                unsigned int entry = ifd + 2 + 12 * i;
+                if (read16(entry) == 0x0112) {
+                    return read16(entry + 8);
+                }
+            }
+        }
+        return 1;
+    }
+};
@@ -1,8 +1,24 @@
 #include "ImageCraft.h"
 #include <QtWidgets/QApplication>
+#include <string>
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "--tiled") {
+        return runTiledCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        return runBenchmarkCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        return runBatchCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--recipe") {
+        return runRecipeCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--video") {
+        return runVideoCommand(argc, argv);
+    }
     QApplication a(argc, argv);
     ImageCraft w;
     w.show();
@@ -0,0 +1,152 @@
+// JpegLosslessTest.cpp
+// Checks Jpeg_Lossless against decoded pixels: every orientation of a synthetic 4:2:0 JPEG is transformed in
+// the DCT domain, decoded, and compared with the same orientation applied to the decoded source.
+// Build: g++ -std=c++17 -I.. JpegLosslessTest.cpp $(pkg-config --cflags --libs opencv4) -ljpeg
+#include "JpegLossless.h"
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Decoded {
+    int width = 0, height = 0;
+    vector<unsigned char> rgb;
+    unsigned short quant[DCTSIZE2] = {};    // luminance table
+};
+
+int failures = 0;
+
+void check(bool condition, const string& what) {
+    cout << (condition ? "ok      " : "FAILED  ") << what << endl;
+    failures += condition ? 0 : 1;
+}
+
+void encode(const string& path, int width, int height) {     // gradients and a flat patch, so every frequency is used
+    vector<unsigned char> rgb(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char* pixel = &rgb[(static_cast<size_t>(y) * width + x) * 3];
+            bool patch = x >= 30 && x < 90 && y >= 40 && y < 80;
+            pixel[0] = patch ? 90 : static_cast<unsigned char>(x * 6 / 5);
+            pixel[1] = patch ? 200 : static_cast<unsigned char>(y * 17 / 10);
+            pixel[2] = patch ? 20 : static_cast<unsigned char>((x * y / 37) % 256);
+        }
+    }
+    jpeg_compress_struct info;
+    jpeg_error_mgr error;
+    info.err = jpeg_std_error(&error);
+    jpeg_create_compress(&info);
+    FILE* file = fopen(path.c_str(), "wb");
+    jpeg_stdio_dest(&info, file);
+    info.image_width = width;
+    info.image_height = height;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);           // YCbCr with 2x2 luma sampling, iMCUs of 16 x 16
+    jpeg_set_quality(&info, 60, TRUE);
+    jpeg_start_compress(&info, TRUE);
+    while (info.next_scanline < info.image_height) {
+        JSAMPROW row = &rgb[static_cast<size_t>(info.next_scanline) * width * 3];
+        jpeg_write_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_compress(&info);
+    fclose(file);
+    jpeg_destroy_compress(&info);
+}
+
+Decoded decode(const string& path) {
+    Decoded decoded;
+    jpeg_decompress_struct info;
+    jpeg_error_mgr error;
+    info.err = jpeg_std_error(&error);
+    jpeg_create_decompress(&info);
+    FILE* file = fopen(path.c_str(), "rb");
+    jpeg_stdio_src(&info, file);
+    jpeg_read_header(&info, TRUE);
+    for (int i = 0; i < DCTSIZE2; i++) {
+        decoded.quant[i] = info.quant_tbl_ptrs[0]->quantval[i];
+    }
+    info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+    decoded.width = info.output_width;
+    decoded.height = info.output_height;
+    decoded.rgb.resize(static_cast<size_t>(decoded.width) * decoded.height * 3);
+    while (info.output_scanline < info.output_height) {
+        JSAMPROW row = &decoded.rgb[static_cast<size_t>(info.output_scanline) * decoded.width * 3];
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    fclose(file);
+    jpeg_destroy_decompress(&info);
+    return decoded;
+}
+
+// Same orientation bits as Edit_Op::orient: 1 transposes, 2 mirrors left-right, 4 mirrors top-bottom, the
+// mirrors in source axes before the transpose.
+int maxDifference(const Decoded& source, const Decoded& output, int orientation) {
+    bool transposed = orientation & 1, mirror_x = orientation & 2, mirror_y = orientation & 4;
+    int largest = 0;
+    for (int y = 0; y < output.height; y++) {
+        for (int x = 0; x < output.width; x++) {
+            int sx = transposed ? y : x, sy = transposed ? x : y;
+            sx = mirror_x ? source.width - 1 - sx : sx;
+            sy = mirror_y ? source.height - 1 - sy : sy;
+            for (int c = 0; c < 3; c++) {
+                int a = output.rgb[(static_cast<size_t>(y) * output.width + x) * 3 + c];
+                int b = source.rgb[(static_cast<size_t>(sy) * source.width + sx) * 3 + c];
+                largest = max(largest, abs(a - b));
+            }
+        }
+    }
+    return largest;
+}
+
+}
+
+int main() {
+    filesystem::path directory = filesystem::temp_directory_path();
+    string source_path = (directory / "imagecraft_lossless_source.jpg").string();
+    string output_path = (directory / "imagecraft_lossless_output.jpg").string();
+    encode(source_path, 192, 144);      // whole iMCUs, so only IDCT and chroma upsampling rounding may differ
+    Decoded source = decode(source_path);
+
+    for (int orientation = 1; orientation < 8; orientation++) {
+        string reason, name = "orientation " + to_string(orientation);
+        bool written = Jpeg_Lossless::transform(source_path, output_path, cv::Rect(0, 0, source.width, source.height), orientation, reason);
+        check(written, name + " is written" + (written ? "" : ": " + reason));
+        if (!written) {
+            continue;
+        }
+        Decoded output = decode(output_path);
+        bool transposed = orientation & 1;
+        check(output.width == (transposed ? source.height : source.width) && output.height == (transposed ? source.width : source.height), name + " has the oriented size");
+        if (output.rgb.size() != source.rgb.size()) {
+            continue;
+        }
+        // an untransposed quantization table dequantizes with the wrong steps, 15 levels and more here
+        int difference = maxDifference(source, output, orientation);
+        check(difference <= 4, name + " matches the oriented source pixels, max difference " + to_string(difference));
+        bool quant_follows = true;
+        for (int k = 0; k < DCTSIZE; k++) {
+            for (int l = 0; l < DCTSIZE; l++) {
+                int from = transposed ? l * DCTSIZE + k : k * DCTSIZE + l;
+                quant_follows = quant_follows && output.quant[k * DCTSIZE + l] == source.quant[from];
+            }
+        }
+        check(quant_follows, name + (transposed ? " transposes" : " keeps") + " the quantization table");
+    }
+
+    string reason;
+    check(!Jpeg_Lossless::transform(source_path, output_path, cv::Rect(8, 0, 64, 64), 0, reason), "a crop off the iMCU grid is refused");
+    check(!Jpeg_Lossless::transform(source_path, output_path, cv::Rect(0, 0, 72, 64), 2, reason), "a mirrored axis of partial iMCUs is refused");
+    check(Jpeg_Lossless::transform(source_path, output_path, cv::Rect(16, 32, 72, 64), 0, reason), "an aligned crop with a partial edge is written");
+
+    remove(source_path.c_str());
+    remove(output_path.c_str());
+    cout << (failures ? to_string(failures) + " check(s) failed" : "all checks passed") << endl;
+    return failures ? 1 : 0;
+}